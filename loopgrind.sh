@@ -3,10 +3,12 @@
 
 LOOPADDR=""
 PIPETOPERL=0
+AUTOLOOP=0
+LOGOPT="--log-fd=1"
 OPTERROR=65
 
 
-while getopts "pa:" flag
+while getopts "pAa:o:" flag
 do
     case $flag in
         a)
@@ -15,10 +17,18 @@ do
         p)
             PIPETOPERL=1
         ;;
+        A)
+            AUTOLOOP=1
+        ;;
+        o)
+            LOGOPT="--out-file=$OPTARG"
+        ;;
         \?)
             echo "Usage: `basename $0` <program path>"
             echo "       `basename $0` -p <program path>"
             echo "       `basename $0` -a <loop address> <program path>"
+            echo "       `basename $0` -A <program path>"
+            echo "       (-o <file> writes records to <file>, %p for the pid, not stdout)"
             exit $OPTERROR          # Exit and explain usage, if no argument(s) given.
         ;;
     esac    
@@ -27,7 +37,12 @@ done
 
 if [[ "" != ${LOOPADDR} ]]
 then
-    ./valgrind-3.5.0/vg-in-place  --tool=loopgrind --loop-addr=$LOOPADDR --debug=no --log-fd=1 ${@:$OPTIND}
+    ./valgrind-3.5.0/vg-in-place  --tool=loopgrind --loop-addr=$LOOPADDR --debug=no "$LOGOPT" ${@:$OPTIND}
+
+
+elif [[ $AUTOLOOP -eq 1 ]]
+then
+    ./valgrind-3.5.0/vg-in-place  --tool=loopgrind --loop-addr=auto --debug=no "$LOGOPT" ${@:$OPTIND}
 
 
 elif [[ $PIPETOPERL -eq 1 ]]
@@ -36,7 +51,7 @@ then
 
 
 else
-    ./valgrind-3.5.0/vg-in-place  --tool=loopgrind --debug=yes --log-fd=1 ${@:$OPTIND}  # | perl tools/graph.pl ${@:$OPTIND}
+    ./valgrind-3.5.0/vg-in-place  --tool=loopgrind --debug=yes "$LOGOPT" ${@:$OPTIND}  # | perl tools/graph.pl ${@:$OPTIND}
 fi  
 
 
@@ -26,61 +26,397 @@
 
 /************************** Shadow table stuff *******************************/
 
-shadow_record* add_shadow_record(VgHashTable ht, Addr addr)
+#define SHADOW_ARENA_CHUNK          1024
+
+static shadow_page *no_page     = NULL;
+
+/* Top up the free list with a fresh chunk of records */
+static void grow_shadow_arena(shadow_table *t)
+{
+    shadow_record *chunk;
+    UInt i;
+
+    chunk = VG_(malloc)("shadow_record", 
+            SHADOW_ARENA_CHUNK * sizeof(shadow_record));
+
+    for (i = 0; i < SHADOW_ARENA_CHUNK; i++)
+    {
+        chunk[i].range_size = 0;
+        chunk[i].range_old = NULL;
+        chunk[i].next_used = t->free_list;
+        t->free_list = &chunk[i];
+    }
+}
+
+/* Find the shadow_page covering addr, making it if asked to.  In the
+ * common case this is a shift, an index and a compare. */
+static shadow_page* get_shadow_page(shadow_table *t, Addr addr, Bool create)
+{
+    UWord key = addr >> SHADOW_PAGE_BITS;
+    shadow_pm_entry *e = &t->primary[key & (SHADOW_PM_SIZE - 1)];
+    shadow_page *page;
+
+    if (e->key == key)
+    {
+        return e->page;
+    }
+
+    page = VG_(HT_lookup)(t->pages, key);
+    if (!page)
+    {
+        if (!create) return NULL;
+
+        page = VG_(calloc)("shadow_page", 1, sizeof(shadow_page));
+        page->key = key;
+        VG_(HT_add_node)(t->pages, (VgHashNode*)page);
+    }
+
+    e->key = key;
+    e->page = page;
+    return page;
+}
+
+static shadow_slot* get_shadow_slot(shadow_page *page, Addr addr)
+{
+    return &page->slots[(addr & (SHADOW_PAGE_SIZE - 1)) >> SHADOW_WORD_BITS];
+}
+
+shadow_table* new_shadow_table(void)
+{
+    shadow_table *t = VG_(malloc)("shadow_table", sizeof(shadow_table));
+    UInt i;
+
+    /* Every table shares the one no_page, so instrumented code can bake in
+     * its address whichever table is in use */
+    if (!no_page)
+    {
+        no_page = VG_(calloc)("shadow_table.no_page", 1, sizeof(shadow_page));
+    }
+    t->no_page = no_page;
+    t->primary = VG_(malloc)("shadow_table.primary", 
+            SHADOW_PM_SIZE * sizeof(shadow_pm_entry));
+    for (i = 0; i < SHADOW_PM_SIZE; i++)
+    {
+        t->primary[i].key = ~(UWord)0;      /* not a page number */
+        t->primary[i].page = t->no_page;
+    }
+    t->pages = VG_(HT_construct)("shadow_table.pages");
+    t->dirty_pages = NULL;
+    t->epoch = 1;
+
+    t->used = NULL;
+    t->used_tail = &t->used;
+    t->n_used = 0;
+
+    t->free_list = NULL;
+    grow_shadow_arena(t);
+    t->last_run = NULL;
+
+    return t;
+}
+
+/* Forget everything in the table in O(1). */
+void reset_shadow_table(shadow_table *t)
+{
+    /* All of this epoch's records go back on the free list */
+    *t->used_tail = t->free_list;
+    t->free_list = t->used;
+
+    t->used = NULL;
+    t->used_tail = &t->used;
+    t->n_used = 0;
+    t->last_run = NULL;
+
+    /* The dirty bits get read straight from instrumented code, which
+     * doesn't know about epochs */
+    while (t->dirty_pages)
+    {
+        VG_(memset)(t->dirty_pages->dirty, 0, sizeof(t->dirty_pages->dirty));
+        t->dirty_pages->page_dirty = 0;
+        t->dirty_pages = t->dirty_pages->next_dirty;
+    }
+
+    /* On the off chance we wrap around, old slots could look current */
+    if (++t->epoch == 0)
+    {
+        shadow_page *page;
+
+        VG_(HT_ResetIter)(t->pages);
+        while ((page = VG_(HT_Next)(t->pages)) != NULL)
+        {
+            VG_(memset)(page->slots, 0, sizeof(page->slots));
+            page->dirty_epoch = 0;
+        }
+        t->epoch = 1;
+    }
+}
+
+static void put_on_dirty_list(shadow_table *t, shadow_page *page)
+{
+    if (page->dirty_epoch != t->epoch)
+    {
+        page->dirty_epoch = t->epoch;
+        page->next_dirty = t->dirty_pages;
+        t->dirty_pages = page;
+    }
+}
+
+static void set_dirty_bit(shadow_table *t, shadow_page *page, Addr addr)
+{
+    UWord offset = addr & (SHADOW_PAGE_SIZE - 1);
+
+    put_on_dirty_list(t, page);
+    page->dirty[offset >> 3] |= 1 << (offset & 7);
+}
+
+shadow_record* add_shadow_record(shadow_table *t, Addr addr)
 {
     shadow_record *r;
+    shadow_page *page;
+    shadow_slot *slot;
    
     tl_assert(addr);
 
-    r = VG_(malloc)("shadow_record", sizeof(shadow_record));
+    if (!t->free_list)
+    {
+        grow_shadow_arena(t);
+    }
+    r = t->free_list;
+    t->free_list = r->next_used;
+
     r->addr = addr;
     r->type = Ity_INVALID;
     r->oldval = 0;
     r->newval = 0;
+    r->oldval_hi = 0;
+    r->newval_hi = 0;
+    r->len = 0;
+
+    r->next_used = NULL;
+    *t->used_tail = r;
+    t->used_tail = &r->next_used;
+    t->n_used++;
 
+    page = get_shadow_page(t, addr, True);
+    slot = get_shadow_slot(page, addr);
+    r->next = (slot->epoch == t->epoch) ? slot->head : NULL;
+    slot->head = r;
+    slot->epoch = t->epoch;
 
-    VG_(HT_add_node)(ht, (VgHashNode *)r);
+    set_dirty_bit(t, page, addr);
 
     return r;
 }
 
 
 
-shadow_record* get_shadow_record(VgHashTable ht, Addr key)
+shadow_record* get_shadow_record(shadow_table *t, Addr key)
+{
+    shadow_page *page;
+    shadow_slot *slot;
+    shadow_record *r;
+
+    tl_assert(t);
+
+    page = get_shadow_page(t, key, False);
+    if (!page) return NULL;
+
+    slot = get_shadow_slot(page, key);
+    if (slot->epoch != t->epoch) return NULL;
+
+    for (r = slot->head; r; r = r->next)
+    {
+        if (r->addr == key) return r;
+    }
+    return NULL;
+}
+
+/* Has a store starting at addr (or a range covering it) been recorded this
+ * epoch?  This is the same test that instrumented code does inline. */
+Bool is_shadow_dirty(shadow_table *t, Addr addr)
+{
+    shadow_page *page = get_shadow_page(t, addr, False);
+    UWord offset = addr & (SHADOW_PAGE_SIZE - 1);
+
+    return page && (page->dirty[offset >> 3] & (1 << (offset & 7)));
+}
+
+/* How many bytes a store of type ty covers, or 0 if it isn't one we shadow */
+UInt shadow_type_size(IRType ty)
+{
+    switch (ty)
+    {
+        case Ity_I8:    return 1;
+        case Ity_I16:   return 2;
+        case Ity_I32:
+        case Ity_F32:   return 4;
+        case Ity_I64:
+        case Ity_F64:   return 8;
+        case Ity_V128:  return 16;
+        default:        return 0;
+    }
+}
+
+/* Append the old bytes of a size-byte value to the range r, and mark them
+ * dirty so stores into the middle of the range don't get records of their
+ * own.  val (and val_hi, for V128) is as it was in memory, so copying it
+ * out keeps host byte order. */
+static void append_to_range(shadow_table *t, shadow_record *r, 
+        ULong val_hi, ULong val, UInt size)
 {
-    tl_assert(ht);
-    return (shadow_record *)VG_(HT_lookup)(ht, key);
+    union {
+        UChar b; UShort h; UInt w; ULong l; ULong v[2]; UChar bytes[16];
+    } u;
+    Addr addr = r->addr + r->len;
+    UInt i;
+
+    if (r->len + size > r->range_size)
+    {
+        r->range_size = SHADOW_RANGE_MAX;
+        r->range_old = VG_(realloc)("shadow_record.range_old", 
+                r->range_old, r->range_size);
+    }
+
+    switch (size)
+    {
+        case 1:     u.b = (UChar)val;   break;
+        case 2:     u.h = (UShort)val;  break;
+        case 4:     u.w = (UInt)val;    break;
+        case 8:     u.l = val;          break;
+        case 16:
+#if defined(VG_BIGENDIAN)
+            u.v[0] = val_hi;
+            u.v[1] = val;
+#else
+            u.v[0] = val;
+            u.v[1] = val_hi;
+#endif
+            break;
+        default:
+            tl_assert2(0, "append_to_range: bad size %u", size);
+    }
+
+    for (i = 0; i < size; i++)
+    {
+        r->range_old[r->len + i] = u.bytes[i];
+        set_dirty_bit(t, get_dirty_shadow_page(t, addr + i), addr + i);
+    }
+    r->len += size;
 }
 
+/* A store to addr, which has no record of its own: if it carries on where
+ * the last record made left off, tack it on to that record (turning it
+ * into a range if need be) and return it.  Otherwise return NULL, and the
+ * caller makes a new record, which becomes t->last_run. */
+shadow_record* extend_shadow_range(shadow_table *t, Addr addr, 
+        IRType type, ULong oldval_hi, ULong oldval)
+{
+    shadow_record *r = t->last_run;
+    UInt size = shadow_type_size(type);
+    UInt r_size;
 
+    tl_assert(size);
+
+    if (!r) return NULL;
+
+    r_size = r->len ? r->len : shadow_type_size(r->type);
+    if (r->addr + r_size != addr || r_size + size > SHADOW_RANGE_MAX)
+    {
+        return NULL;
+    }
+
+    if (!r->len)
+    {
+        append_to_range(t, r, r->oldval_hi, r->oldval, r_size);
+    }
+    append_to_range(t, r, oldval_hi, oldval, size);
+
+    return r;
+}
+
+/* Get the page covering addr, and make sure it'll be on this epoch's list
+ * of dirty pages.  Setting page_dirty is up to the caller. */
+shadow_page* get_dirty_shadow_page(shadow_table *t, Addr addr)
+{
+    shadow_page *page = get_shadow_page(t, addr, True);
+
+    put_on_dirty_list(t, page);
+    return page;
+}
+
+
+
+/* A store's type as it goes in a binary 'W' record (see lg_output.h), so
+ * that readers don't depend on VEX's IRType numbering */
+static UInt out_type_code(IRType ty)
+{
+    switch (ty)
+    {
+        case Ity_F32:
+        case Ity_F64:   return shadow_type_size(ty) | OUT_TYPE_FLOAT;
+        case Ity_V128:  return shadow_type_size(ty) | OUT_TYPE_VECTOR;
+        default:        return shadow_type_size(ty);
+    }
+}
 
 void pp_shadow_record(shadow_record* r) {
+    union { UInt i; float f; } old32, new32;
+    union { ULong i; double d; } old64, new64;
+
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_WRITE);
+        out_addr(r->addr);
+        out_uvarint(out_type_code(r->type));
+        out_uvarint(r->oldval);
+        out_uvarint(r->newval);
+        if (r->type == Ity_V128)
+        {
+            out_uvarint(r->oldval_hi);
+            out_uvarint(r->newval_hi);
+        }
+        return;
+    }
+
     switch (r->type)
     {
         case Ity_I1:
-            VG_(printf)("W %p : %d => %d\n", r->addr, 
+            out_printf("W %p : %d => %d\n", r->addr, 
                                              (r->oldval ? 1 : 0), 
                                              (r->newval ? 1 : 0) );
             break;
         case Ity_I8:
-            VG_(printf)("W %p : 0x------%02lx => 0x------%02lx\n", 
+            out_printf("W %p : 0x------%02llx => 0x------%02llx\n", 
                     r->addr, r->oldval, r->newval);
             break;
         case Ity_I16:
-            VG_(printf)("W %p : 0x----%04lx => 0x----%04lx\n", 
+            out_printf("W %p : 0x----%04llx => 0x----%04llx\n", 
                     r->addr, r->oldval, r->newval);
             break;
         case Ity_I32:
-            VG_(printf)("W %p : 0x%08lx => 0x%08lx\n", 
+            out_printf("W %p : 0x%08llx => 0x%08llx\n", 
                     r->addr, r->oldval, r->newval);
             break;
-        case Ity_F32:
-            VG_(printf)("W %p : 0x%08f => 0x%08f\n", 
+        case Ity_I64:
+            out_printf("W %p : 0x%016llx => 0x%016llx\n", 
                     r->addr, r->oldval, r->newval);
             break;
+        case Ity_F32:
+            old32.i = (UInt)r->oldval;
+            new32.i = (UInt)r->newval;
+            out_printf("W %p : %f => %f\n", 
+                    r->addr, (double)old32.f, (double)new32.f);
+            break;
         case Ity_F64:
-            VG_(printf)("W %p : 0x%Lf => 0x %Lf\n",
-                    r->addr, r->oldval, r->newval);
+            old64.i = r->oldval;
+            new64.i = r->newval;
+            out_printf("W %p : %f => %f\n",
+                    r->addr, old64.d, new64.d);
+            break;
+        case Ity_V128:
+            out_printf("W %p : 0x%016llx%016llx => 0x%016llx%016llx\n", 
+                    r->addr, r->oldval_hi, r->oldval, 
+                    r->newval_hi, r->newval);
             break;
         default:
             tl_assert2(0, "log_shadow_write: IRType not implemented");
@@ -88,20 +424,68 @@ void pp_shadow_record(shadow_record* r) {
 
 }
 
+/* Print a range record's bytes in address order.  now is the range as it
+ * is in memory at the moment, or NULL if that's not readable. */
+void pp_shadow_range(shadow_record *r, UChar *now)
+{
+    static const char hex[] = "0123456789abcdef";
+    char old_hex[2 * SHADOW_RANGE_MAX + 1], new_hex[2 * SHADOW_RANGE_MAX + 1];
+    UInt i;
+
+    tl_assert(r->len && r->len <= SHADOW_RANGE_MAX);
+
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_RANGE);
+        out_addr(r->addr);
+        out_uvarint(r->len);
+        out_bytes(r->range_old, r->len);
+        out_byte(now ? 1 : 0);
+        if (now)
+        {
+            out_bytes(now, r->len);
+        }
+        return;
+    }
+
+    for (i = 0; i < r->len; i++)
+    {
+        old_hex[2 * i]      = hex[r->range_old[i] >> 4];
+        old_hex[2 * i + 1]  = hex[r->range_old[i] & 0xf];
+        if (now)
+        {
+            new_hex[2 * i]      = hex[now[i] >> 4];
+            new_hex[2 * i + 1]  = hex[now[i] & 0xf];
+        }
+    }
+    old_hex[2 * r->len] = '\0';
+    new_hex[now ? 2 * r->len : 0] = '\0';
+
+    out_printf("W %p +%u : %s => %s\n", r->addr, r->len, old_hex, 
+            now ? new_hex : "(unmapped)");
+}
+
 
 /************************* Superblock record stuff ***************************/
 sb_record* add_sb_record(VgHashTable ht, Addr key) 
 {
+    char fn_name[256];
     sb_record *r = VG_(malloc)("sb_record", sizeof(sb_record));
     r->addr = key;
-    VG_(memset)(r->fn_name, 0, sizeof(r->fn_name));
+    r->fn_name = NULL;
     r->count = 0;
-    r->jump_targets = VG_(HT_construct)("jump_targets");
-
-    VG_(get_fnname_if_entry)(
-            key,
-            r->fn_name,
-            sizeof(r->fn_name));
+    r->last_succ = 0;
+    r->last_succ_node = NULL;
+    r->last_succ_edge = 0;
+    r->back_weight = 0;
+    r->back_edges = 0;
+    r->back_sbs = 0;
+    r->last_back_at = 0;
+
+    if (VG_(get_fnname_if_entry)(key, fn_name, sizeof(fn_name)))
+    {
+        r->fn_name = VG_(strdup)("sb_record.fn_name", fn_name);
+    }
 
     VG_(HT_add_node)(ht, (VgHashNode*)r);
 
@@ -114,35 +498,161 @@ sb_record* get_sb_record(VgHashTable ht, Addr key)
 }
 
 
-void pp_sb_record(sb_record *r)
+/* err is the estimated error in r->count if it came from sampling, or 0 */
+void pp_sb_record(sb_record *r, ULong err)
 {
-    static int depth = 0;
-    static char space_buffer[1024];
-    sb_record *child;
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_NODE);
+        out_addr(r->addr);
+        out_uvarint(r->count);
+        out_uvarint(err);
+        if (r->fn_name)
+        {
+            UInt len = VG_(strlen)(r->fn_name);
+
+            out_byte(OUT_TAG_FNNAME);
+            out_addr(r->addr);
+            out_uvarint(len);
+            out_bytes((UChar *)r->fn_name, len);
+        }
+        return;
+    }
 
-    VG_(memset)(space_buffer, ' ', (depth < 1024) ? depth : 1024);
-    space_buffer[depth] = 0;
+    if (err)
+    {
+        out_printf("NODE 0x%08lx (%llu) +/- %llu\n", r->addr, r->count, err);
+    }
+    else
+    {
+        out_printf("NODE 0x%08lx (%llu)\n", r->addr, r->count);
+    }
 
-    VG_(printf)("NODE 0x%08lx (%lu)\n", r->addr, r->count);
+    if (r->fn_name)
+    {
+        out_printf("FNNAME 0x%08lx %s\n", r->addr, r->fn_name);
+    }
+}
+
+
+
+/***************************** Edge table stuff ******************************/
 
+#define EDGE_TABLE_INIT_SLOTS   4096
+
+static UInt edge_hash(Addr src, Addr dst)
+{
+    UWord h = (src * 0x9E3779B1) ^ (dst + (dst >> 7));
+
+    return (UInt)(h ^ (h >> 16));
+}
+
+/* Linear probe for (src, dst); returns the slot that holds it, or the free
+ * slot where it belongs. */
+static UInt* edge_slot(edge_table *t, Addr src, Addr dst)
+{
+    UInt mask = t->n_slots - 1;
+    UInt i = edge_hash(src, dst) & mask;
 
-    if (r->fn_name[0])
+    while (t->slots[i])
     {
-        VG_(printf)("FNNAME 0x%08lx %s\n", r->addr, r->fn_name);
+        edge_record *e = &t->entries[t->slots[i] - 1];
+
+        if (e->src == src && e->dst == dst)
+        {
+            break;
+        }
+        i = (i + 1) & mask;
     }
 
+    return &t->slots[i];
+}
+
+/* Double the probe array and reinsert everything.  Entries don't move. */
+static void grow_edge_slots(edge_table *t)
+{
+    UInt i;
 
-    VG_(HT_ResetIter)(r->jump_targets);
+    VG_(free)(t->slots);
+    t->n_slots *= 2;
+    t->slots = VG_(calloc)("edge_table.slots", t->n_slots, sizeof(UInt));
 
-    while ((child = VG_(HT_Next)(r->jump_targets)) != NULL)
+    for (i = 0; i < t->n_entries; i++)
     {
-        VG_(printf)("EDGE 0x%08lx => 0x%08lx (%lu)\n",
-                r->addr, child->addr, child->count);
+        *edge_slot(t, t->entries[i].src, t->entries[i].dst) = i + 1;
+    }
+}
+
+edge_table* new_edge_table(void)
+{
+    edge_table *t = VG_(malloc)("edge_table", sizeof(edge_table));
+
+    t->n_slots = EDGE_TABLE_INIT_SLOTS;
+    t->slots = VG_(calloc)("edge_table.slots", t->n_slots, sizeof(UInt));
+
+    t->n_entries = 0;
+    t->entries_size = EDGE_TABLE_INIT_SLOTS / 2;
+    t->entries = VG_(malloc)("edge_table.entries", 
+            t->entries_size * sizeof(edge_record));
 
-        depth++;
-        pp_sb_record(child);
-        depth--;
+    return t;
+}
+
+edge_record* add_edge_record(edge_table *t, Addr src, Addr dst)
+{
+    UInt *slot;
+    edge_record *e;
+
+    /* Keep the load factor under 1/2 so probe runs stay short */
+    if (2 * (t->n_entries + 1) > t->n_slots)
+    {
+        grow_edge_slots(t);
     }
+    if (t->n_entries == t->entries_size)
+    {
+        t->entries_size *= 2;
+        t->entries = VG_(realloc)("edge_table.entries", t->entries, 
+                t->entries_size * sizeof(edge_record));
+    }
+
+    e = &t->entries[t->n_entries++];
+    e->src = src;
+    e->dst = dst;
+    e->count = 0;
+
+    slot = edge_slot(t, src, dst);
+    *slot = t->n_entries;
+
+    return e;
+}
 
+edge_record* get_edge_record(edge_table *t, Addr src, Addr dst)
+{
+    UInt *slot = edge_slot(t, src, dst);
+
+    return *slot ? &t->entries[*slot - 1] : NULL;
 }
 
+void pp_edge_record(edge_record *e, ULong err)
+{
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_EDGE);
+        out_addr(e->src);
+        out_addr(e->dst);
+        out_uvarint(e->count);
+        out_uvarint(err);
+        return;
+    }
+
+    if (err)
+    {
+        out_printf("EDGE 0x%08lx => 0x%08lx (%llu) +/- %llu\n", 
+                e->src, e->dst, e->count, err);
+    }
+    else
+    {
+        out_printf("EDGE 0x%08lx => 0x%08lx (%llu)\n", 
+                e->src, e->dst, e->count);
+    }
+}
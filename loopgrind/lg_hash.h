@@ -11,6 +11,8 @@
 #include "pub_tool_libcbase.h"
 #include "pub_tool_options.h"
 
+#include "lg_output.h"
+
 /******************************** structs ************************************/
 
 
@@ -19,34 +21,184 @@ typedef struct _sb_record
     struct _sb_record   *next;
     Addr                addr;
 
-    char                fn_name[256];
+    char                *fn_name;   /* NULL unless addr is a function entry */
     ULong               count;
-    VgHashTable         jump_targets;
+
+    /* Memo of the last jump out of this SB, so that trace_superblock can
+     * skip both hash lookups when a block keeps going to the same place.
+     * The edge is an index into edge_table.entries. */
+    Addr                last_succ;
+    struct _sb_record   *last_succ_node;
+    UInt                last_succ_edge;
+
+    /* --loop-addr=auto: back edges into this SB, weighted like count, and
+     * how many SBs ran between them. */
+    ULong               back_weight;
+    ULong               back_edges;
+    ULong               back_sbs;
+    ULong               last_back_at;
 } 
 sb_record;
 
 
 
+/* One edge in the SB graph.  These are kept packed together in
+ * edge_table.entries, so keep them small (24 bytes on a 64-bit host). */
+typedef struct _edge_record
+{
+    Addr                src;
+    Addr                dst;
+    ULong               count;
+}
+edge_record;
+
+
+/* Open-addressing hash table of all SB graph edges, keyed by (src, dst).
+ * The probe array only holds indices into the dense entries array, so an
+ * edge keeps its index (but not necessarily its address) for the life of
+ * the table; instrumentation that wants to bump a count inline has to go
+ * through the entries pointer. */
+typedef struct _edge_table
+{
+    edge_record         *entries;
+    UInt                n_entries;
+    UInt                entries_size;
+
+    UInt                *slots;     /* entry index + 1, or 0 if free */
+    UInt                n_slots;    /* always a power of two */
+}
+edge_table;
+
+
+
 typedef struct _shadow_record
 {
-    struct _shadow_record  *next;
+    struct _shadow_record  *next;       /* other records in the same word */
+    struct _shadow_record  *next_used;  /* this epoch's records, or free list */
     Addr                addr;
 
     IRType              type;
-    Long                oldval;
-    Long                newval;
+    ULong               oldval;     /* zero-extended; floats as raw bits */
+    ULong               newval;
+    ULong               oldval_hi;  /* top half of V128 stores */
+    ULong               newval_hi;
+
+    /* A run of adjacent stores, of whatever width, gets coalesced into one
+     * record covering len bytes, with the old bytes kept here in address
+     * order; type and the vals don't mean anything then.  The buffer stays
+     * with the record when it's recycled. */
+    UInt                len;        /* 0 unless this is a range */
+    UInt                range_size;
+    UChar               *range_old;
 }
 shadow_record;
 
+#define SHADOW_RANGE_MAX    256
+
+/* Shadow memory is kept memcheck-style, in a two-level map: the primary
+ * map finds the shadow_page for a page of guest memory, and the page has a
+ * slot for each word in it.  A slot lists the records for stores to that
+ * word, but only if its epoch is current; bumping the epoch wipes the whole
+ * map at once. */
+#define SHADOW_PAGE_BITS    12
+#define SHADOW_PAGE_SIZE    (1 << SHADOW_PAGE_BITS)
+#define SHADOW_WORD_BITS    2
+#define SHADOW_PAGE_WORDS   (SHADOW_PAGE_SIZE >> SHADOW_WORD_BITS)
+#if VG_WORDSIZE == 4
+#define SHADOW_PM_BITS      (32 - SHADOW_PAGE_BITS)
+#else
+#define SHADOW_PM_BITS      16
+#endif
+#define SHADOW_PM_SIZE      (1 << SHADOW_PM_BITS)
+
+typedef struct _shadow_slot
+{
+    UInt                epoch;
+    shadow_record       *head;
+}
+shadow_slot;
+
+/* Besides the slots, a page has a bit for every byte of it that a store
+ * has started at this epoch, so that instrumented code can tell with a
+ * couple of loads whether a store needs a record made for it.  Unlike the
+ * slots these have to be cleared for real, so the pages that have any set
+ * are kept on a list. */
+typedef struct _shadow_page
+{
+    struct _shadow_page *next;
+    UWord               key;        /* guest addr >> SHADOW_PAGE_BITS */
+
+    struct _shadow_page *next_dirty;
+    UInt                dirty_epoch;    /* on the dirty list if current */
+    UChar               dirty[SHADOW_PAGE_SIZE / 8];
+
+    /* For diffing whole pages instead: set once the page has been copied
+     * into snap this epoch (also tested inline). */
+    UChar               page_dirty;
+    UChar               *snap;
+
+    shadow_slot         slots[SHADOW_PAGE_WORDS];
+}
+shadow_page;
+
+/* The primary map is direct-mapped on the low bits of the page number.  On
+ * 32-bit hosts it has an entry for every page (8MB a table), so it
+ * covers the address space exactly; on 64-bit hosts it has 64K, and pages
+ * that collide get fetched from the pages table on a miss.  Empty entries
+ * point at the table's no_page, which is never dirty, so inline code can
+ * always follow the page pointer. */
+typedef struct _shadow_pm_entry
+{
+    UWord               key;
+    shadow_page         *page;
+}
+shadow_pm_entry;
+
+
+/* Shadow memory table: maps Addrs -> shadow_record, for one loop iteration
+ * at a time.  Rather than freeing everything at the end of an iteration, we
+ * bump the epoch, which makes every slot from before look empty, and put
+ * the iteration's records back on the free list in one go.  Records come out
+ * of an arena and never get returned to the allocator. */
+typedef struct _shadow_table
+{
+    shadow_pm_entry     *primary;
+    VgHashTable         pages;      /* every shadow_page we've made */
+    shadow_page         *no_page;    /* the same for every table */
+    shadow_page         *dirty_pages;
+    UInt                epoch;
+
+    shadow_record       *used;      /* everything handed out this epoch */
+    shadow_record       **used_tail;
+    UInt                n_used;
+
+    shadow_record       *free_list;
+
+    shadow_record       *last_run;  /* latest record a store can extend */
+}
+shadow_table;
+
 /**************************** Function prototypes ****************************/
 
-shadow_record *add_shadow_record(VgHashTable, Addr);
-shadow_record* get_shadow_record(VgHashTable, Addr);
+shadow_table* new_shadow_table(void);
+void reset_shadow_table(shadow_table*);
+shadow_record *add_shadow_record(shadow_table*, Addr);
+shadow_record* get_shadow_record(shadow_table*, Addr);
+shadow_page* get_dirty_shadow_page(shadow_table*, Addr);
+Bool is_shadow_dirty(shadow_table*, Addr);
+shadow_record* extend_shadow_range(shadow_table*, Addr, IRType, ULong, ULong);
+UInt shadow_type_size(IRType);
 void pp_shadow_record(shadow_record*);
+void pp_shadow_range(shadow_record*, UChar *now);
 
 sb_record* add_sb_record(VgHashTable, Addr);
 sb_record* get_sb_record(VgHashTable, Addr);
-void pp_sb_record(sb_record *r);
+void pp_sb_record(sb_record *r, ULong err);
+
+edge_table* new_edge_table(void);
+edge_record* add_edge_record(edge_table*, Addr, Addr);
+edge_record* get_edge_record(edge_table*, Addr, Addr);
+void pp_edge_record(edge_record *e, ULong err);
 
 
 #endif
@@ -29,24 +29,36 @@
 #include "pub_tool_debuginfo.h"
 #include "pub_tool_libcbase.h"
 #include "pub_tool_options.h"
-#include "pub_tool_machine.h"     // VG_(fnptr_to_fnentry)
+#include "pub_tool_machine.h"     // VG_(fnptr_to_fnentry), VG_STACK_REDZONE_SZB
+#include "pub_tool_aspacemgr.h"   // VG_(am_is_valid_for_client)
+#include "pub_tool_vki.h"         // VKI_PROT_READ
+#include "pub_tool_clreq.h"       // VG_IS_TOOL_USERREQ
 
 #include "lg_hash.h"
+#include "lg_objmap.h"
+#include "lg_snapshot.h"
+#include "lg_output.h"
+#include "loopgrind.h"
 
 
 
 /****************************** globals **************************************/
 
-#define TEXT_SEG_BEGIN 0x08048000
-#define HEAP_SEG_END   0x40000000
-#define KERN_SEG_BEGIN 0xc0000000
+/* Bounds on addresses that make sense to pass on the command line */
+#define MIN_USER_ADDR  0x1000
+#define MAX_USER_ADDR  (sizeof(Addr) == 8 ? 0x7fffffffffffffffLL : 0xffffffffLL)
 
 
 /* Global superblock hash table: maps Addrs -> sb_record */
 VgHashTable global_bb_ht    = NULL;
 
-/* Shadow memory table: maps Addrs -> shadow_record */
-VgHashTable shadow_table    = NULL;
+/* Every edge in the SB graph: maps (src, dst) -> edge_record */
+edge_table *global_edge_table = NULL;
+
+/* Shadow memory table: maps Addrs -> shadow_record.  This is the table of
+ * the innermost loop we're in at the moment (see loop_header_hit); until
+ * we're in one, nothing gets shadowed and there isn't one. */
+shadow_table *global_shadow_table = NULL;
 
 
 
@@ -54,18 +66,131 @@ VgHashTable shadow_table    = NULL;
 /************************** Command-line args ********************************/
 
 /* Since the actual main loop event header is currently being figured out offline,
- * we can take the address as an argument in order to actually do stuff. */
-static Addr clo_loop_addr     = 0;
+ * we can take the address as an argument in order to actually do stuff.  There
+ * can be a few of these, for loops nested inside each other; each gets its
+ * own shadow table and its own iteration counts. */
+#define MAX_LOOPS 16
+
+typedef struct _loop_info
+{
+    Addr                addr;
+    shadow_table        *shadow;
+    watch_copy          *snaps;     /* --shadow-mode=snapshot */
+    ULong               entries;
+    ULong               iterations;
+    Bool                body_known;  /* see left_loop_body */
+}
+loop_info;
+
+static loop_info loops[MAX_LOOPS];
+static Int  n_loops             = 0;
+
+/* --loop-addr=auto: find the header ourselves while tracing the SB graph,
+ * by counting back edges into each SB, and start diffing memory there once
+ * we're sure enough.  A header has to have had clo_find_loop_threshold
+ * back edges' worth of weight (one each at main()'s depth), with iterations
+ * of at least clo_find_loop_min_body SBs on average so that we don't pick
+ * some little initialization loop. */
+static Bool clo_find_loop       = False;
+static Int  clo_find_loop_threshold = 1000;
+static Int  clo_find_loop_min_body  = 16;
 
 
 /* Be even more verbose than usual. */
 static Bool clo_debug_mode      = False;
 
+/* How trace_superblock weighs an SB hit by its distance from main()'s frame
+ * (see calculate_weight).  WEIGHT_RAW skips all that and just counts. */
+typedef enum { WEIGHT_EXP, WEIGHT_LINEAR, WEIGHT_STEP, WEIGHT_RAW } weight_model_t;
+static weight_model_t clo_weight_model = WEIGHT_EXP;
+static Int  clo_weight_decay    = 512;      /* bytes of stack per 1/e (or step) */
+static Int  clo_weight_cutoff   = 0x750;    /* deeper than this weighs nothing */
+
+/* Sample the SB graph instead of tracing every hit: out of every
+ * clo_sample_period SBs executed, only trace a burst of clo_sample_burst
+ * consecutive ones.  0 traces everything. */
+static Int  clo_sample_period   = 0;
+static Int  clo_sample_burst    = 1000;
+
+/* Shared objects (by soname glob) whose code we instrument along with the
+ * main program, e.g. the libevent that's running our event loop for us. */
+#define MAX_INCLUDE_OBJS 16
+static Char *clo_include_objs[MAX_INCLUDE_OBJS];
+static Int  n_include_objs      = 0;
+
+/* How the memory diff at a loop header gets worked out.  SHADOW_STORES
+ * shadows every store the target makes; SHADOW_PAGES only has stores mark
+ * their page dirty, and diffs dirty pages against a copy taken when they
+ * were first stored to; SHADOW_SNAPSHOT doesn't instrument stores at all,
+ * and instead compares the --watch regions against a copy taken at the last
+ * header hit. */
+typedef enum { SHADOW_STORES, SHADOW_PAGES, SHADOW_SNAPSHOT } shadow_mode_t;
+static shadow_mode_t clo_shadow_mode = SHADOW_STORES;
+
+/* Don't shadow stores to the stack: anywhere from the red zone below SP up,
+ * or if clo_stack_depth is set, only up to that many bytes above SP (so the
+ * frames the loop itself runs in still get tracked). */
+static Bool clo_ignore_stack_writes = False;
+static Int  clo_stack_depth     = 0;
+
+/* Only shadow stores in blocks that have run between two hits on a loop
+ * header, i.e. the loop body and whatever it calls.  Everything
+ * else (startup, teardown) gets no shadow instrumentation at all. */
+static Bool clo_loop_body_only  = False;
+
+/* Write records as text or in the binary format (see lg_output.h); binary
+ * has to go to a file of its own, --out-file or --out-fd, rather than in
+ * with everything else in the log. */
+static Bool clo_binary_output   = False;
+static Int  clo_out_fd          = -1;
+static Char *clo_out_file       = NULL;
+
+/* Report hit rates and such at exit. */
+static Bool clo_stats           = False;
+
+/* Print the SB graph every so often too, not just at exit, for programs
+ * that never get there: every clo_dump_every instrumented SBs, or every
+ * clo_dump_every seconds if the option ends in 's'.  0 means only when
+ * the program asks with LOOPGRIND_DUMP(). */
+static UInt clo_dump_every      = 0;
+static Bool clo_dump_seconds    = False;
+static Bool clo_dump_reset      = False;   /* windowed counts */
+
+/* A file to look in for queries every so often while the program runs
+ * (see control_poll); %p and %q{VAR} get expanded as for --log-file. */
+static Char *clo_control_file   = NULL;
+
+/* Whether to start tracing at main() and shadowing stores straight away,
+ * or wait for the program to ask with the loopgrind.h client requests. */
+static Bool clo_trace_atstart   = True;
+static Bool clo_shadow_atstart  = True;
+
+
+/* How SB graph edges get counted.  TRACE_DIRTY calls trace_superblock on
+ * every executed superblock and weighs each hit by stack depth; TRACE_INLINE
+ * allocates a counter per statically-known edge at translation time and
+ * bumps it with plain IR, so only indirect jumps and returns pay for a
+ * helper call.  Inline counts are raw execution counts.  TRACE_BUFFERED
+ * has the instrumented code append hits to a buffer with plain IR, and only
+ * calls out to aggregate them once the buffer fills up. */
+typedef enum { TRACE_DIRTY, TRACE_INLINE, TRACE_BUFFERED } trace_mode_t;
+static trace_mode_t clo_trace_mode = TRACE_DIRTY;
+
+/* TRACE_BUFFERED: how many SB hits to queue up before aggregating them. */
+static Int  clo_event_buffer_size = 65536;
+
 
 /* We're not interested in analyzing gory libc startup/pulldown functions,
- * so only log after hitting the main SB and stop when we find a call to exit */
+ * so only log after hitting the main SB and stop when we find a call to exit.
+ * Whether a given SB gets instrumented is decided once, when it's translated,
+ * by should_instrument; flipping this discards everything that might have
+ * been translated the other way. */
 static Bool logging             = False;
 
+/* Likewise for shadowing stores in the code we're logging, which the
+ * program can also turn on and off (see --shadow-atstart). */
+static Bool shadowing           = True;
+
 /* We use the entry function's address to register when the target program jumps
  * into library calls, and the "values" for all jumps in the SB graph are weighed
  * exponentially less the farther away the destination is from the initial frame. */
@@ -76,6 +201,12 @@ static Addr  log_entry_ebp    = 0x0;
 static char* log_exit_fnname    = "exit";
 
 static Addr curr_bb_addr        = 0x0;
+static sb_record *curr_node     = NULL;   /* curr_bb_addr's record, if known */
+static Addr curr_ebp            = 0x0;    /* frame pointer on entry to it */
+
+/* TRACE_INLINE: the last SB we ran before control went off into untracked
+ * code, or 0 if we're still in the target. */
+static Addr untracked_src       = 0x0;
 
 
 /******************** Helpful utility functions ******************************/
@@ -83,35 +214,213 @@ static Addr curr_bb_addr        = 0x0;
 
 /* Calculates the weight that should be assigned to an edge in the SB graph.  Because
  * one of our tenets states that the main loop shouldn't be far up the backtrace,
- * we penalize SBs that are far away from main on the stack.  So, we have an
- * exponential decay model function, arbitrarily chosen to be
+ * we penalize SBs that are far away from main on the stack.  By default we have
+ * an exponential decay model function, arbitrarily chosen to be
  *
  * y = 1000 * exp(-(1/512)x)
  *
- * Also, because Valgrind doesn't have floating point support yet (!!!), 
- * we scale up everything by 1000.
+ * and everything deeper than 0x750 bytes counts for nothing.  Since the weight
+ * only depends on the stack depth, we work out all the possible values once in
+ * build_weight_table and just index into that on the hot path.
  */
+#define WEIGHT_SCALE        1000
+#define WEIGHT_DEPTH_SHIFT  4       /* quantize depths to 16-byte granules */
+
+static ULong *weight_table      = NULL;
+static UInt  weight_table_size  = 0;
+
+/* exp(-x) for x >= 0.  No libm in here, so halve x until the Taylor series
+ * converges quickly and square the result back up. */
+static double exp_neg(double x)
+{
+    double y = 1.0, term = 1.0;
+    Int i, halvings = 0;
+
+    while (x > 0.5)
+    {
+        x /= 2.0;
+        halvings++;
+    }
+
+    for (i = 1; i < 10; i++)
+    {
+        term *= -x / i;
+        y += term;
+    }
+
+    while (halvings--)
+    {
+        y *= y;
+    }
+
+    return y;
+}
+
+static void build_weight_table(void)
+{
+    UInt i;
+
+    weight_table_size = (clo_weight_cutoff >> WEIGHT_DEPTH_SHIFT) + 1;
+    weight_table = VG_(malloc)("weight_table", 
+            weight_table_size * sizeof(ULong));
+
+    for (i = 0; i < weight_table_size; i++)
+    {
+        UInt depth = i << WEIGHT_DEPTH_SHIFT;
+        double y = 0.0;
+
+        switch (clo_weight_model)
+        {
+            case WEIGHT_EXP:
+                y = exp_neg((double)depth / clo_weight_decay);
+                break;
+            case WEIGHT_LINEAR:
+                y = 1.0 - (double)depth / (clo_weight_cutoff + 1);
+                break;
+            case WEIGHT_STEP:
+                y = (depth < clo_weight_decay) ? 1.0 : 0.0;
+                break;
+            default:
+                tl_assert2(0, "build_weight_table: bad weight model");
+        }
+
+        weight_table[i] = (ULong)(y * WEIGHT_SCALE);
+    }
+}
+
+/* Code built without a frame pointer (--include-obj libraries, most
+ * amd64 code) leaves whatever it likes in ebp, often something above
+ * main()'s frame; we can't tell how deep that is, so call it depth 0. */
 static ULong calculate_weight(Addr ebp)
 {
-    double x, y = 1.0;
+    Addr depth;
 
     tl_assert(log_entry_ebp);
-    
-    if ((log_entry_ebp - ebp) > 0x750) return 0;
 
+    if (ebp > log_entry_ebp)
+    {
+        return weight_table[0];
+    }
+
+    depth = (log_entry_ebp - ebp) >> WEIGHT_DEPTH_SHIFT;
+
+    return depth < weight_table_size ? weight_table[depth] : 0;
+}
+
+/* Is this address part of the target program (as opposed to some shared
+ * library that we don't want to instrument)?  The object map is filled in
+ * from the debug info once we find main(), see process_main_SB. */
+static Bool is_tracked_code(Addr addr)
+{
+    return objmap_contains(addr);
+}
+
+static Addr const_to_addr(IRConst *c)
+{
+    switch (c->tag)
+    {
+        case Ico_U32: return (Addr)c->Ico.U32;
+        case Ico_U64: return (Addr)c->Ico.U64;
+        default:
+            tl_assert2(0, "const_to_addr: jump target isn't a word");
+    }
+    return 0;
+}
+
+/* Objects that should never be instrumented, whatever --include-obj says */
+static Char *system_objs[] = { "libc.so*", "ld-linux*", "ld.so*", NULL };
+
+/* Does obj match one of the --include-obj patterns? */
+static Bool is_included_object(const DebugInfo *obj)
+{
+    const Char *name = (const Char*)VG_(seginfo_soname)(obj);
+    Int i;
+
+    if (!name || !*name)
+    {
+        /* No DT_SONAME; fall back to the file's basename */
+        name = (const Char*)VG_(seginfo_filename)(obj);
+        if (!name) return False;
+        if (VG_(strrchr)(name, '/')) name = VG_(strrchr)(name, '/') + 1;
+    }
+
+    for (i = 0; system_objs[i]; i++)
+    {
+        if (VG_(string_match)(system_objs[i], name)) return False;
+    }
+    for (i = 0; i < n_include_objs; i++)
+    {
+        if (VG_(string_match)(clo_include_objs[i], name)) return True;
+    }
+    return False;
+}
+
+/* Objects we've already looked at and decided not to include, along with
+ * their text, so that unmapping one only evicts that one */
+#define MAX_EXCLUDED_OBJS 64
+static code_range excluded_objs[MAX_EXCLUDED_OBJS];
+static Int n_excluded_objs      = 0;
+
+/* Check whether the code at addr belongs to an --include-obj object we
+ * haven't come across yet (say, one that was dlopen'd), and track it if so. */
+static Bool include_object_at(Addr addr)
+{
+    DebugInfo *obj;
+    Int i;
+
+    if (n_include_objs == 0) return False;
+
+    obj = VG_(find_seginfo)(addr);
+    if (!obj || objmap_has_object(obj)) return False;
+
+    for (i = 0; i < n_excluded_objs; i++)
+    {
+        if (excluded_objs[i].obj == obj) return False;
+    }
+
+    if (!is_included_object(obj))
+    {
+        if (n_excluded_objs < MAX_EXCLUDED_OBJS)
+        {
+            code_range *ex = &excluded_objs[n_excluded_objs++];
+            ex->start = VG_(seginfo_get_text_avma)(obj);
+            ex->end = ex->start + VG_(seginfo_get_text_size)(obj);
+            ex->obj = obj;
+        }
+        return False;
+    }
+
+    if (clo_debug_mode)
+        VG_(printf)("* Tracking %s *\n", VG_(seginfo_filename)(obj));
+
+    objmap_add_object(obj);
+    return True;
+}
 
-    x = -((double)(log_entry_ebp - ebp))/512.0;
+/* Should an SB starting at addr carry any SB graph/shadow instrumentation?
+ * This has to be a property of the block alone, since Valgrind will happily
+ * keep reusing the translation long after the fact. */
+static Bool should_instrument(Addr addr)
+{
+    return logging && (is_tracked_code(addr) || include_object_at(addr));
+}
 
+/* Throw away all the translations of code we track, so they get
+ * reinstrumented according to the current state of things.  Safe to call
+ * from lg_instrument or a helper: the translation being built (or run)
+ * isn't affected, the next dispatch to any of these blocks just misses. */
+static void discard_tracked_translations(void)
+{
+    UInt i;
 
-    /* Taylor series unrolled for OMG MAXIMUM FASTNESS */
-    y += x;
-    y += (x * x) / 2.0;
-    y += (x * x * x) / 6.0;
-    y += (x * x * x * x) / 24.0;
-    y += (x * x * x * x * x) / 120.0;
-    y += (x * x * x * x *x * x) / 720.0;
+    for (i = 0; i < objmap_n_ranges(); i++)
+    {
+        code_range *r = objmap_get_range(i);
 
-    return (ULong)(y * 1000.0);  /* ouch! */
+        VG_(discard_translations)((Addr64)r->start, 
+                (ULong)(r->end - r->start),
+                "loopgrind");
+    }
 }
 
 static void start_logging(void)
@@ -120,7 +429,11 @@ static void start_logging(void)
     {
         VG_(printf)("*** instrumentation enabled ***\n");
     }
-    logging = True;
+    if (!logging)
+    {
+        logging = True;
+        discard_tracked_translations();
+    }
 }
 
 static void stop_logging(void)
@@ -129,218 +442,1938 @@ static void stop_logging(void)
     {
         VG_(printf)("*** instrumentation disabled ***\n");
     }
-    logging = False;
+    if (logging)
+    {
+        logging = False;
+        discard_tracked_translations();
+    }
 }
 
 
 /* Handle entering the program's entry point. */
-static  void process_main_SB(IRSB *bb)
+static  void process_main_SB(Addr addr)
 {
-    IRStmt *first_stmt = bb->stmts[0];
+    DebugInfo *target = VG_(find_seginfo)(addr);
+    const DebugInfo *obj;
 
     if(clo_debug_mode)
-        VG_(printf)("* Found %s() at %08llx *\n", 
-                log_entry_fnname, first_stmt->Ist.IMark.addr);
+        VG_(printf)("* Found %s() at %08lx *\n", log_entry_fnname, addr);
+
+    /* Whatever object main() lives in is the program we want to look at;
+     * this works for PIEs just as well as for anything linked at 0x8048000. */
+    tl_assert(target);
+    if (!objmap_has_object(target))
+    {
+        objmap_add_object(target);
+
+        if (clo_debug_mode)
+            VG_(printf)("* Tracking %s *\n", VG_(seginfo_filename)(target));
+    }
 
-    /* We now care about what Valgrind is executing!! */
-    start_logging();
-    curr_bb_addr = log_entry_addr = first_stmt->Ist.IMark.addr;
+    /* Same goes for any --include-obj libraries that are already loaded;
+     * they have to be in the map before start_logging throws away their
+     * uninstrumented translations.  Later ones get picked up lazily. */
+    for (obj = VG_(next_seginfo)(NULL); obj; obj = VG_(next_seginfo)(obj))
+    {
+        if (n_include_objs && !objmap_has_object(obj) && 
+                is_included_object(obj))
+        {
+            if (clo_debug_mode)
+                VG_(printf)("* Tracking %s *\n", VG_(seginfo_filename)(obj));
+
+            objmap_add_object(obj);
+        }
+    }
+
+    /* We now care about what Valgrind is executing!!  Unless the program
+     * is going to say when; if it already has, there's finally something
+     * to instrument. */
+    if (clo_trace_atstart)
+    {
+        start_logging();
+    }
+    else if (logging)
+    {
+        discard_tracked_translations();
+    }
+    log_entry_addr = addr;
 
-    add_sb_record(global_bb_ht, curr_bb_addr);
+    /* Nothing we've seen jumped to main() */
+    curr_bb_addr = 0x0;
+    curr_node = NULL;
 }
 
 /* Handle leaving the program. */
-static  void process_exit_SB(IRSB *bb)
+static  void process_exit_SB(Addr addr)
 {
-    IRStmt *first_stmt = bb->stmts[0];
-
     if(clo_debug_mode)
-        VG_(printf)("* Found %s() at %08llx *\n", 
-                log_exit_fnname, first_stmt->Ist.IMark.addr);
+        VG_(printf)("* Found %s() at %08lx *\n", log_exit_fnname, addr);
 
     /* Stop logging so we don't track process pulldown stuff. */
     stop_logging();
     log_entry_addr = 0x0;
 }
 
-
-
-/* U-widen 8/16/32 bit int expr to 32.  Sort of stolen from Chronicle's
- * add_trace_store_flatten() */
-static IRTemp widen_expr_to_32_bits (IRSB *bb, IRExpr* e )
+
+
+/* Add e to bb as a temp of its own */
+static IRTemp assign_new_temp(IRSB *bb, IRType ty, IRExpr *e)
+{
+    IRTemp t = newIRTemp(bb->tyenv, ty);
+    addStmtToIRSB(bb, IRStmt_WrTmp(t, e));
+    return t;
+}
+
+/* U-widen the value of a store (any type a guest can write to memory) to
+ * 64-bit chunks we can pass to a helper: *lo gets the low 64 bits, and *hi
+ * the high 64 bits if e is a 128-bit value, or IRTemp_INVALID otherwise.
+ * Floats are passed as their bit patterns.  Sort of stolen from Chronicle's
+ * add_trace_store_flatten().  e must be an atom. */
+static void widen_expr_to_64_bits (IRSB *bb, IRExpr* e, IRTemp *lo, IRTemp *hi)
+{
+    IRTemp t;
+
+    *hi = IRTemp_INVALID;
+
+    switch (typeOfIRExpr(bb->tyenv,e)) 
+    {
+        case Ity_I8:
+            t = assign_new_temp(bb, Ity_I32, 
+                    IRExpr_Unop(Iop_8Uto32, deepCopyIRExpr(e)));
+            *lo = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_32Uto64, IRExpr_RdTmp(t)));
+            break;
+        case Ity_I16:
+            t = assign_new_temp(bb, Ity_I32, 
+                    IRExpr_Unop(Iop_16Uto32, deepCopyIRExpr(e)));
+            *lo = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_32Uto64, IRExpr_RdTmp(t)));
+            break;
+        case Ity_I32:
+            *lo = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_32Uto64, deepCopyIRExpr(e)));
+            break;
+        case Ity_F32:
+            t = assign_new_temp(bb, Ity_I32, 
+                    IRExpr_Unop(Iop_ReinterpF32asI32, deepCopyIRExpr(e)));
+            *lo = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_32Uto64, IRExpr_RdTmp(t)));
+            break;
+        case Ity_I64:
+            *lo = assign_new_temp(bb, Ity_I64, deepCopyIRExpr(e));
+            break;
+        case Ity_F64:
+            *lo = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_ReinterpF64asI64, deepCopyIRExpr(e)));
+            break;
+        case Ity_V128:
+            *lo = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_V128to64, deepCopyIRExpr(e)));
+            *hi = assign_new_temp(bb, Ity_I64, 
+                    IRExpr_Unop(Iop_V128HIto64, deepCopyIRExpr(e)));
+            break;
+        default:  ppIRType(typeOfIRExpr(bb->tyenv,e)); 
+                  tl_assert2(0, "widen_expr_to_64_bits: unimplemented IRType conversion"); 
+    }
+} 
+
+/************** SB graph generation callback functions ************************/
+
+
+/* How often trace_superblock's last-successor memo saves us the lookups */
+static ULong n_memo_hits        = 0;
+static ULong n_memo_misses      = 0;
+
+
+/* Find (or create) the node record for the superblock at addr. */
+static sb_record* lookup_node(Addr addr)
+{
+    sb_record *node = get_sb_record(global_bb_ht, addr);
+
+    if (!node)
+    {
+        node = add_sb_record(global_bb_ht, addr);
+    }
+
+    return node;
+}
+
+/* Find (or create) the edge record for the jump src => dst. */
+static edge_record* lookup_edge(Addr src, Addr dst)
+{
+    edge_record *edge = get_edge_record(global_edge_table, src, dst);
+
+    if (!edge)
+    {
+        /* If we don't have the current sb hashed, there's something fishy */
+        tl_assert(get_sb_record(global_bb_ht, src));
+
+        edge = add_edge_record(global_edge_table, src, dst);
+    }
+
+    return edge;
+}
+
+
+/* Pick tracing back up at key without an edge leading into it, because we
+ * don't know where we came from. */
+static void restart_trace(Addr key)
+{
+    lookup_node(key);
+    curr_bb_addr = key;
+    curr_node = NULL;
+    curr_ebp = 0;
+}
+
+
+/* --loop-addr=auto: a jump backwards from curr_bb_addr to node, within
+ * the same frame and not to a function entry (so not a call, and not a
+ * return either), is a loop's back edge.  Once one looks like the loop
+ * we're after, shadow memory from there on as though we'd been given it
+ * with --loop-addr. */
+static void note_back_edge(sb_record *node, ULong weight)
+{
+    ULong now = n_memo_hits + n_memo_misses;
+    ULong scale = (clo_weight_model == WEIGHT_RAW) ? 1 : WEIGHT_SCALE;
+
+    if (node->last_back_at)
+    {
+        node->back_sbs += now - node->last_back_at;
+    }
+    node->last_back_at = now;
+    node->back_edges++;
+    node->back_weight += weight;
+
+    if (node->back_weight < (ULong)clo_find_loop_threshold * scale ||
+            node->back_sbs < (ULong)clo_find_loop_min_body * node->back_edges)
+    {
+        return;
+    }
+
+    VG_(umsg)("Found loop header at %p (%llu back edges, %llu SBs each)\n",
+            node->addr, node->back_edges, node->back_sbs / node->back_edges);
+
+    loops[0].addr = node->addr;
+    loops[0].shadow = new_shadow_table();
+    loops[0].snaps = snapshot_new_copies();
+    n_loops = 1;
+    clo_find_loop = False;
+
+    /* The header has to be translated again to call loop_header_hit */
+    discard_tracked_translations();
+}
+
+
+/* Callback when instrumented execution jumps to a new superblock */
+static void trace_superblock(Addr ebp, Addr key)
+{
+    sb_record *node, *prev;
+    edge_record *edge;
+    ULong weight;
+
+
+    /* main()'s own first SB: its frame isn't set up yet, so wait until
+     * the next one to grab the frame pointer. */
+    if (curr_bb_addr == 0)
+    {
+        restart_trace(key);
+        return;
+    }
+
+    /* Little trick: since we know the entry point of main() is the first
+     * one we'll see, if log_entry_ebp is unset, set it now. */
+    if (log_entry_ebp == 0)
+    {
+        log_entry_ebp = ebp;
+    }
+
+
+    tl_assert(key != 0);
+
+    weight = (clo_weight_model == WEIGHT_RAW) ? 1 : calculate_weight(ebp);
+
+    prev = curr_node ? curr_node : get_sb_record(global_bb_ht, curr_bb_addr);
+
+    /* If we don't have the current sb hashed, there's something fishy */
+    tl_assert(prev);
+
+
+    /* Most blocks jump to the same place as last time; if so we already
+     * know both records we need to bump. */
+    if (prev->last_succ == key)
+    {
+        node = prev->last_succ_node;
+        edge = &global_edge_table->entries[prev->last_succ_edge];
+        n_memo_hits++;
+    }
+    else
+    {
+        node = lookup_node(key);
+        edge = lookup_edge(curr_bb_addr, key);
+
+        prev->last_succ = key;
+        prev->last_succ_node = node;
+        prev->last_succ_edge = edge - global_edge_table->entries;
+        n_memo_misses++;
+    }
+
+
+    /* Increment global superblock counter */
+    node->count += weight;
+
+    if (clo_debug_mode)
+    {
+        VG_(printf)("EBP %p\n", log_entry_ebp - ebp);
+        VG_(printf)("SB %08lx: (%lu)\n", node->addr, node->count);
+    }
+
+
+    /* Increment jump target count in current superblock */
+    edge->count += weight;
+
+    if (clo_find_loop && key <= curr_bb_addr && ebp == curr_ebp && 
+            !node->fn_name)
+    {
+        note_back_edge(node, weight);
+    }
+
+    if (clo_debug_mode)
+        VG_(printf)("JP %08lx -> %08lx (%lu)\n\n", 
+                edge->src,
+                edge->dst,
+                edge->count);
+
+    curr_bb_addr = key;
+    curr_node = node;
+    curr_ebp = ebp;
+
+}
+
+
+/* Sampled tracing.  Every instrumented SB decrements sample_countdown
+ * inline, and trace_sampled_superblock only gets called for the last
+ * clo_sample_burst values of each period. */
+static UInt  sample_countdown   = 0;
+static ULong n_sample_bursts    = 0;
+
+static void trace_sampled_superblock(Addr ebp, Addr key)
+{
+    /* Since we weren't watching before the burst started, we don't know
+     * where its first SB was jumped to from. */
+    if (sample_countdown == clo_sample_burst - 1)
+    {
+        if (log_entry_ebp == 0 && curr_bb_addr != 0)
+        {
+            log_entry_ebp = ebp;
+        }
+        restart_trace(key);
+        n_sample_bursts++;
+    }
+    else
+    {
+        trace_superblock(ebp, key);
+    }
+
+    if (sample_countdown == 0)
+    {
+        sample_countdown = clo_sample_period;
+    }
+}
+
+/* Emit IR to decrement *countdown; returns an Ity_I1 temp that says
+ * whether it's now below threshold (for sampling, whether this SB hit is
+ * in a burst). */
+static IRTemp add_countdown(IRSB *bb, UInt *countdown, UInt threshold)
+{
+    IRTemp count    = newIRTemp(bb->tyenv, Ity_I32);
+    IRTemp next     = newIRTemp(bb->tyenv, Ity_I32);
+    IRTemp below    = newIRTemp(bb->tyenv, Ity_I1);
+    IRExpr *countdown_addr = mkIRExpr_HWord( (HWord)countdown );
+
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(count, 
+                IRExpr_Load(False, Iend_LE, Ity_I32, countdown_addr)));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(next,
+                IRExpr_Binop(Iop_Sub32, 
+                    IRExpr_RdTmp(count), IRExpr_Const(IRConst_U32(1)))));
+    addStmtToIRSB(bb,
+            IRStmt_Store(Iend_LE, IRTemp_INVALID,
+                deepCopyIRExpr(countdown_addr), IRExpr_RdTmp(next)));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(below,
+                IRExpr_Binop(Iop_CmpLT32U, 
+                    IRExpr_RdTmp(next), 
+                    IRExpr_Const(IRConst_U32(threshold)))));
+
+    return below;
+}
+
+/* A rough 2-sigma bound on the sampling error of a count.  Treating the
+ * bursts as Poisson arrivals that each contribute at most
+ * clo_sample_burst * WEIGHT_SCALE to the count, the variance is at most
+ * that times the count itself. */
+static ULong sample_error_bound(ULong count)
+{
+    ULong v, x, y;
+
+    if (clo_sample_period == 0 || count == 0) return 0;
+
+    v = count * clo_sample_burst * 
+        (clo_weight_model == WEIGHT_RAW ? 1 : WEIGHT_SCALE);
+
+    /* Integer square root by Newton's method */
+    x = v;
+    y = (x + 1) / 2;
+    while (y < x)
+    {
+        x = y;
+        y = (x + v / x) / 2;
+    }
+
+    return 2 * x;
+}
+
+
+/* TRACE_BUFFERED: instrumented code appends one of these per SB hit.  We
+ * don't bother storing the source block, since it's just the key of the
+ * event before. */
+typedef struct
+{
+    Addr    key;
+    Addr    ebp;
+}
+sb_event;
+
+/* ... which flush_events expands into these to sort and aggregate */
+typedef struct
+{
+    Addr    src;
+    Addr    dst;
+    ULong   weight;
+}
+sb_transition;
+
+static sb_event      *event_buf     = NULL;
+static HWord         n_events       = 0;
+static sb_transition *transitions   = NULL;
+
+static Int cmp_transitions(void *a, void *b)
+{
+    sb_transition *ta = a, *tb = b;
+
+    if (ta->src != tb->src) return ta->src < tb->src ? -1 : 1;
+    if (ta->dst != tb->dst) return ta->dst < tb->dst ? -1 : 1;
+    return 0;
+}
+
+/* Fold the buffered SB hits into the graph.  Sorting them by edge first
+ * means each distinct edge costs us one set of lookups per batch, and the
+ * lookups themselves come in address order. */
+static void flush_events(void)
+{
+    HWord i, j, first = 0, n = n_events;
+
+    if (n == 0) return;
+
+    /* Same tricks as trace_superblock */
+    if (curr_bb_addr == 0)
+    {
+        restart_trace(event_buf[0].key);
+        first = 1;
+    }
+    if (log_entry_ebp == 0 && first < n)
+    {
+        log_entry_ebp = event_buf[first].ebp;
+    }
+
+    for (i = first; i < n; i++)
+    {
+        transitions[i - first].src = i ? event_buf[i - 1].key : curr_bb_addr;
+        transitions[i - first].dst = event_buf[i].key;
+        transitions[i - first].weight = (clo_weight_model == WEIGHT_RAW) ? 
+            1 : calculate_weight(event_buf[i].ebp);
+    }
+    curr_bb_addr = event_buf[n - 1].key;
+    curr_node = NULL;
+    n_events = 0;
+    n -= first;
+
+    VG_(ssort)(transitions, n, sizeof(sb_transition), cmp_transitions);
+
+    for (i = 0; i < n; i = j)
+    {
+        ULong weight = 0;
+
+        for (j = i; j < n && cmp_transitions(&transitions[i], 
+                    &transitions[j]) == 0; j++)
+        {
+            weight += transitions[j].weight;
+        }
+
+        /* The source may only show up as a destination later in the batch */
+        lookup_node(transitions[i].src);
+
+        lookup_node(transitions[i].dst)->count += weight;
+        lookup_edge(transitions[i].src, transitions[i].dst)->count += weight;
+    }
+}
+
+
+/* Emit IR to append (key, ebp) to event_buf, flushing if that fills it. */
+static void add_event_append(IRSB *bb, Addr key, IRTemp ebp, IRType hWordTy)
+{
+    Bool is64 = (hWordTy == Ity_I64);
+    IRTemp idx   = newIRTemp(bb->tyenv, hWordTy);
+    IRTemp off   = newIRTemp(bb->tyenv, hWordTy);
+    IRTemp ev    = newIRTemp(bb->tyenv, hWordTy);
+    IRTemp ebp_p = newIRTemp(bb->tyenv, hWordTy);
+    IRTemp next  = newIRTemp(bb->tyenv, hWordTy);
+    IRTemp full  = newIRTemp(bb->tyenv, Ity_I1);
+    IRDirty *di;
+
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(idx,
+                IRExpr_Load(False, Iend_LE, hWordTy,
+                    mkIRExpr_HWord( (HWord)&n_events ))));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(off,
+                IRExpr_Binop(is64 ? Iop_Mul64 : Iop_Mul32,
+                    IRExpr_RdTmp(idx), mkIRExpr_HWord(sizeof(sb_event)))));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(ev,
+                IRExpr_Binop(is64 ? Iop_Add64 : Iop_Add32,
+                    mkIRExpr_HWord( (HWord)event_buf ), IRExpr_RdTmp(off))));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(ebp_p,
+                IRExpr_Binop(is64 ? Iop_Add64 : Iop_Add32,
+                    IRExpr_RdTmp(ev), 
+                    mkIRExpr_HWord(offsetof(sb_event, ebp)))));
+
+    addStmtToIRSB(bb,
+            IRStmt_Store(Iend_LE, IRTemp_INVALID,
+                IRExpr_RdTmp(ev), mkIRExpr_HWord(key)));
+    addStmtToIRSB(bb,
+            IRStmt_Store(Iend_LE, IRTemp_INVALID,
+                IRExpr_RdTmp(ebp_p), IRExpr_RdTmp(ebp)));
+
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(next,
+                IRExpr_Binop(is64 ? Iop_Add64 : Iop_Add32,
+                    IRExpr_RdTmp(idx), mkIRExpr_HWord(1))));
+    addStmtToIRSB(bb,
+            IRStmt_Store(Iend_LE, IRTemp_INVALID,
+                mkIRExpr_HWord( (HWord)&n_events ), IRExpr_RdTmp(next)));
+
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(full,
+                IRExpr_Binop(is64 ? Iop_CmpEQ64 : Iop_CmpEQ32,
+                    IRExpr_RdTmp(next), 
+                    mkIRExpr_HWord(clo_event_buffer_size))));
+
+    di = unsafeIRDirty_0_N(
+            0, "flush_events",
+            VG_(fnptr_to_fnentry)( &flush_events ),
+            mkIRExprVec_0());
+    di->guard = IRExpr_RdTmp(full);
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
+
+
+/* Callback for TRACE_INLINE blocks that leave through a jump we couldn't
+ * resolve at translation time (returns, indirect jumps and calls). */
+static void trace_dynamic_edge(Addr src, Addr dst)
+{
+    if (is_tracked_code(dst))
+    {
+        lookup_edge(src, dst)->count++;
+    }
+    else
+    {
+        untracked_src = src;
+    }
+}
+
+/* Callback for the first TRACE_INLINE block we see after coming back from
+ * untracked code: credit the edge to whoever made the call. */
+static void trace_untracked_return(Addr dst)
+{
+    lookup_edge(untracked_src, dst)->count++;
+    untracked_src = 0;
+}
+
+
+/* Emit IR equivalent to *counter_addr += delta, where both are atoms and
+ * delta is an Ity_I64. */
+static void add_counter_increment(IRSB *bb, IRExpr *counter_addr, IRExpr *delta)
+{
+    IRTemp t1 = newIRTemp(bb->tyenv, Ity_I64);
+    IRTemp t2 = newIRTemp(bb->tyenv, Ity_I64);
+
+    addStmtToIRSB(bb, 
+            IRStmt_WrTmp(t1, 
+                IRExpr_Load(False, Iend_LE, Ity_I64, counter_addr)));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(t2,
+                IRExpr_Binop(Iop_Add64, IRExpr_RdTmp(t1), delta)));
+    addStmtToIRSB(bb,
+            IRStmt_Store(Iend_LE, IRTemp_INVALID,
+                deepCopyIRExpr(counter_addr), IRExpr_RdTmp(t2)));
+}
+
+
+/* Count the edge src => dst every time the guard (an Ity_I1 atom, or NULL
+ * for "always") holds.  The edge table's entries array can be reallocated
+ * as the graph grows, so rather than baking in the count's address we load
+ * the array base at run time and index off of that. */
+static void add_edge_increment(IRSB *bb, Addr src, Addr dst, IRExpr *guard,
+        IRType hWordTy)
+{
+    edge_record *edge;
+    HWord offset;
+    IRTemp base, counter_addr;
+    IRExpr *delta = IRExpr_Const(IRConst_U64(1));
+
+    lookup_node(src);
+    edge = lookup_edge(src, dst);
+    offset = (HWord)&edge->count - (HWord)global_edge_table->entries;
+
+    base = newIRTemp(bb->tyenv, hWordTy);
+    counter_addr = newIRTemp(bb->tyenv, hWordTy);
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(base,
+                IRExpr_Load(False, Iend_LE, hWordTy,
+                    mkIRExpr_HWord( (HWord)&global_edge_table->entries ))));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(counter_addr,
+                IRExpr_Binop(hWordTy == Ity_I64 ? Iop_Add64 : Iop_Add32,
+                    IRExpr_RdTmp(base), mkIRExpr_HWord(offset))));
+
+    if (guard)
+    {
+        IRTemp t = newIRTemp(bb->tyenv, Ity_I64);
+        addStmtToIRSB(bb, 
+                IRStmt_WrTmp(t, 
+                    IRExpr_Unop(Iop_1Uto64, deepCopyIRExpr(guard))));
+        delta = IRExpr_RdTmp(t);
+    }
+
+    add_counter_increment(bb, IRExpr_RdTmp(counter_addr), delta);
+}
+
+
+/* Instrument the entry of a TRACE_INLINE superblock. */
+static void add_entry_increment(IRSB *bb, Addr addr, IRType hWordTy)
+{
+    IRTemp src = newIRTemp(bb->tyenv, hWordTy);
+    IRTemp returning = newIRTemp(bb->tyenv, Ity_I1);
+    IRDirty *di;
+
+    add_counter_increment(bb, 
+            mkIRExpr_HWord( (HWord)&lookup_node(addr)->count ),
+            IRExpr_Const(IRConst_U64(1)));
+
+    /* If control left the target through untracked code, the edge back in
+     * ends here; that's the only case that costs us a helper call. */
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(src,
+                IRExpr_Load(False, Iend_LE, hWordTy, 
+                    mkIRExpr_HWord( (HWord)&untracked_src ))));
+    addStmtToIRSB(bb,
+            IRStmt_WrTmp(returning,
+                IRExpr_Binop(hWordTy == Ity_I64 ? Iop_CmpNE64 : Iop_CmpNE32,
+                    IRExpr_RdTmp(src), mkIRExpr_HWord(0))));
+
+    di = unsafeIRDirty_0_N(
+            0, "trace_untracked_return",
+            VG_(fnptr_to_fnentry)( &trace_untracked_return ),
+            mkIRExprVec_1( mkIRExpr_HWord(addr) ));
+    di->guard = IRExpr_RdTmp(returning);
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
+
+
+/* Instrument the way out of a TRACE_INLINE superblock.  Like TRACE_DIRTY
+ * mode, a call into code we don't track isn't an edge by itself; the edge
+ * gets recorded once control comes back into the target. */
+static void add_exit_increment(IRSB *bb, Addr src, IRExpr *next, 
+        IRType hWordTy)
+{
+    Addr dst;
+
+    if (next->tag != Iex_Const)
+    {
+        IRDirty *di = unsafeIRDirty_0_N(
+                0, "trace_dynamic_edge",
+                VG_(fnptr_to_fnentry)( &trace_dynamic_edge ),
+                mkIRExprVec_2( mkIRExpr_HWord(src), deepCopyIRExpr(next) ));
+        addStmtToIRSB(bb, IRStmt_Dirty(di));
+        return;
+    }
+
+    dst = const_to_addr(next->Iex.Const.con);
+    if (is_tracked_code(dst))
+    {
+        add_edge_increment(bb, src, dst, NULL, hWordTy);
+    }
+    else
+    {
+        addStmtToIRSB(bb,
+                IRStmt_Store(Iend_LE, IRTemp_INVALID,
+                    mkIRExpr_HWord( (HWord)&untracked_src ),
+                    mkIRExpr_HWord(src)));
+    }
+}
+
+
+
+/* Dumping the SB graph while the program runs.  For --dump-every, every
+ * instrumented SB decrements dump_countdown inline, the same way as
+ * sample_countdown, and dump_tick gets called when it hits zero.  Counting
+ * down in seconds, it only looks at the clock every DUMP_CLOCK_SBS SBs, so
+ * a program sitting idle in a system call doesn't get dumped until it
+ * wakes up again. */
+#define DUMP_CLOCK_SBS      (1 << 16)
+
+static UInt  dump_countdown     = 0;
+static UInt  last_dump_ms       = 0;
+static UInt  n_dumps            = 0;
+
+/* Nodes and edges stay put (inline counters point right at them), only
+ * the counts go.  The back edge counts for --loop-addr=auto aren't
+ * reported, so they keep going. */
+static void reset_sb_graph(void)
+{
+    sb_record *r;
+    UInt i;
+
+    VG_(HT_ResetIter)(global_bb_ht);
+    while ((r = VG_(HT_Next)(global_bb_ht)) != NULL)
+    {
+        r->count = 0;
+    }
+    for (i = 0; i < global_edge_table->n_entries; i++)
+    {
+        global_edge_table->entries[i].count = 0;
+    }
+    for (i = 0; i < (UInt)n_loops; i++)
+    {
+        loops[i].iterations = 0;
+        loops[i].entries = 0;
+    }
+    n_sample_bursts = 0;
+}
+
+/* Print everything lg_fini would, so that each dump stands on its own.
+ * With reset, the counts start over afterwards and the next dump only
+ * covers what ran since this one. */
+static void dump_sb_graph(Bool reset)
+{
+    sb_record *r;
+    UInt i;
+
+    if (clo_trace_mode == TRACE_BUFFERED)
+    {
+        flush_events();
+    }
+
+    for (i = 0; i < (UInt)n_loops; i++)
+    {
+        if (out_is_binary())
+        {
+            out_byte(OUT_TAG_LOOP);
+            out_addr(loops[i].addr);
+            out_uvarint(loops[i].iterations);
+            out_uvarint(loops[i].entries);
+        }
+        else
+        {
+            out_printf("LOOP 0x%08lx (%llu iterations, %llu entries)\n",
+                    loops[i].addr, loops[i].iterations, loops[i].entries);
+        }
+    }
+
+    if (clo_sample_period && out_is_binary())
+    {
+        out_byte(OUT_TAG_SAMPLE);
+        out_uvarint(clo_sample_period);
+        out_uvarint(clo_sample_burst);
+        out_uvarint(n_sample_bursts);
+    }
+    else if (clo_sample_period)
+    {
+        out_printf("SAMPLE period %d burst %d (%llu bursts)\n",
+                clo_sample_period, clo_sample_burst, n_sample_bursts);
+    }
+
+    VG_(HT_ResetIter)(global_bb_ht);
+
+    while ((r = VG_(HT_Next)(global_bb_ht)) != NULL)
+    {
+        //    VG_(umsg)("%08lx\t%lu\n",
+        //                r->addr,
+        //                r->count);
+        pp_sb_record(r, sample_error_bound(r->count));
+    }
+
+    for (i = 0; i < global_edge_table->n_entries; i++)
+    {
+        edge_record *e = &global_edge_table->entries[i];
+        pp_edge_record(e, sample_error_bound(e->count));
+    }
+
+    out_flush();
+
+    if (reset)
+    {
+        reset_sb_graph();
+    }
+}
+
+/* Every dump but the one at exit starts with a DUMP record, numbered from
+ * 1, saying when it was taken; whatever follows up to the next one is that
+ * dump.  The exit dump gets one too if there were any before it. */
+static void pp_dump_begin(void)
+{
+    UInt now = VG_(read_millisecond_timer)();
+
+    n_dumps++;
+
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_DUMP);
+        out_uvarint(n_dumps);
+        out_uvarint(now);
+    }
+    else
+    {
+        out_printf("DUMP %u (%u ms)\n", n_dumps, now);
+    }
+}
+
+static void dump_now(void)
+{
+    pp_dump_begin();
+    dump_sb_graph(clo_dump_reset);
+}
+
+static void dump_tick(void)
+{
+    if (clo_dump_seconds)
+    {
+        UInt now = VG_(read_millisecond_timer)();
+
+        dump_countdown = DUMP_CLOCK_SBS;
+        if (now - last_dump_ms < clo_dump_every * 1000)
+        {
+            return;
+        }
+        last_dump_ms = now;
+    }
+    else
+    {
+        dump_countdown = clo_dump_every;
+    }
+
+    dump_now();
+}
+
+static void add_dump_countdown(IRSB *bb)
+{
+    IRDirty *di = unsafeIRDirty_0_N(
+            0, "dump_tick",
+            VG_(fnptr_to_fnentry)( &dump_tick ),
+            mkIRExprVec_0());
+    di->guard = IRExpr_RdTmp(add_countdown(bb, &dump_countdown, 1));
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
+
+
+
+/************************ Shadow memory functions ****************************/
+
+
+/* --loop-body-only: every block with stores in it that we've seen run since
+ * the first loop header hit.  A block starts out pending, and gets into the
+ * body once the header comes around again; then it's retranslated with
+ * its stores shadowed.  (So the iteration a block is discovered in doesn't
+ * see its stores.) */
+typedef struct _loop_block
+{
+    struct _loop_block  *next;
+    Addr                addr;
+    Bool                in_body;
+}
+loop_block;
+
+static VgHashTable loop_body_ht  = NULL;
+static loop_block **pending_blocks = NULL;
+static UInt n_pending_blocks    = 0;
+static UInt pending_blocks_size = 0;
+
+/* Read inline by blocks outside the body: nonzero once we've hit the
+ * header, so there's no point noting blocks before then. */
+static HWord loop_body_watch    = 0;
+
+static Bool in_loop_body(Addr addr)
+{
+    loop_block *b = VG_(HT_lookup)(loop_body_ht, addr);
+
+    return b && b->in_body;
+}
+
+/* Callback for a block with stores that isn't in the loop body (yet). */
+static void note_loop_block(Addr addr)
+{
+    loop_block *b = VG_(HT_lookup)(loop_body_ht, addr);
+
+    if (b) return;
+
+    b = VG_(malloc)("loop_block", sizeof(loop_block));
+    b->addr = addr;
+    b->in_body = False;
+    VG_(HT_add_node)(loop_body_ht, (VgHashNode*)b);
+
+    if (n_pending_blocks == pending_blocks_size)
+    {
+        pending_blocks_size = pending_blocks_size ? 2 * pending_blocks_size : 64;
+        pending_blocks = VG_(realloc)("pending_blocks", pending_blocks,
+                pending_blocks_size * sizeof(loop_block*));
+    }
+    pending_blocks[n_pending_blocks++] = b;
+}
+
+/* Back at the header: whatever ran since the last time is in the loop, so
+ * throw away the unshadowed translations of it. */
+static void commit_loop_blocks(void)
+{
+    UInt i;
+
+    loop_body_watch = 1;
+
+    for (i = 0; i < n_pending_blocks; i++)
+    {
+        pending_blocks[i]->in_body = True;
+        VG_(discard_translations)((Addr64)pending_blocks[i]->addr, 1,
+                "commit_loop_blocks");
+    }
+    n_pending_blocks = 0;
+}
+
+/* Emit a call to note_loop_block at the top of the block at addr, guarded
+ * on loop_body_watch. */
+static void add_loop_block_note(IRSB *bb, Addr addr, IRType hWordTy)
+{
+    IRTemp watch, watching;
+    IRDirty *di;
+
+    watch = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy, 
+                mkIRExpr_HWord( (HWord)&loop_body_watch )));
+    watching = assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(hWordTy == Ity_I64 ? Iop_CmpNE64 : Iop_CmpNE32,
+                IRExpr_RdTmp(watch), mkIRExpr_HWord(0)));
+
+    di = unsafeIRDirty_0_N(
+            0, "note_loop_block",
+            VG_(fnptr_to_fnentry)( &note_loop_block ),
+            mkIRExprVec_1( mkIRExpr_HWord(addr) ));
+    di->guard = IRExpr_RdTmp(watching);
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
+
+
+
+
+/* Only the first store to an address in an iteration calls out to
+ * log_shadow_write, so the last value stored there is whatever's there now.
+ * If it's been unmapped since, make do with the first store's value. */
+static void read_back_newval(shadow_record *r)
+{
+    SizeT size = shadow_type_size(r->type);
+
+    if (size == 0 ||
+            !VG_(am_is_valid_for_client)(r->addr, size, VKI_PROT_READ))
+    {
+        return;
+    }
+
+    switch (size)
+    {
+        case 1:     r->newval = *(UChar *)r->addr;   break;
+        case 2:     r->newval = *(UShort *)r->addr;  break;
+        case 4:     r->newval = *(UInt *)r->addr;    break;
+        case 8:     r->newval = *(ULong *)r->addr;   break;
+        case 16:
+#if defined(VG_BIGENDIAN)
+            r->newval_hi = ((ULong *)r->addr)[0];
+            r->newval = ((ULong *)r->addr)[1];
+#else
+            r->newval = ((ULong *)r->addr)[0];
+            r->newval_hi = ((ULong *)r->addr)[1];
+#endif
+            break;
+    }
+}
+
+static void pp_diff_begin(Addr header)
+{
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_DIFF);
+        out_addr(header);
+    }
+    else
+    {
+        out_printf(" *** Memory diff since last entry into %p ***\n", header);
+    }
+}
+
+/* Diffs going to the log go out as they happen, since that's where someone
+ * is watching them; ones going to a file of their own can wait for the
+ * buffer to fill. */
+static void pp_diff_end(void)
+{
+    if (out_is_binary())
+    {
+        out_byte(OUT_TAG_DIFF_END);
+    }
+    else
+    {
+        out_printf(" ***\n");
+    }
+
+    if (!out_has_fd())
+    {
+        out_flush();
+    }
+}
+
+/* Report everything l's iteration wrote, and start over. */
+static void print_and_reset_shadow_mem(loop_info *l)
+{
+    shadow_table *t = l->shadow;
+    shadow_record *r;
+
+    if (!shadowing) return;
+
+    pp_diff_begin(l->addr);
+
+    if (clo_shadow_mode == SHADOW_SNAPSHOT)
+    {
+        snapshot_diff_regions(l->snaps);
+        pp_diff_end();
+        return;
+    }
+
+    if (clo_shadow_mode == SHADOW_PAGES)
+    {
+        shadow_page *page;
+
+        for (page = t->dirty_pages; page; 
+                page = page->next_dirty)
+        {
+            Addr base = page->key << SHADOW_PAGE_BITS;
+
+            if (page->page_dirty && 
+                    VG_(am_is_valid_for_client)(base, SHADOW_PAGE_SIZE, 
+                        VKI_PROT_READ))
+            {
+                snapshot_diff(base, page->snap, SHADOW_PAGE_SIZE);
+            }
+        }
+
+        pp_diff_end();
+        reset_shadow_table(t);
+        return;
+    }
+
+    for (r = t->used; r; r = r->next_used)
+    {
+        if (r->len)
+        {
+            Bool readable = VG_(am_is_valid_for_client)(r->addr, r->len, 
+                    VKI_PROT_READ);
+
+            pp_shadow_range(r, readable ? (UChar *)r->addr : NULL);
+            continue;
+        }
+
+        read_back_newval(r);
+        pp_shadow_record(r);
+    }
+
+    pp_diff_end();
+
+    reset_shadow_table(t);
+}
+
+
+/* The loops we're in at the moment, as indices into loops[], innermost
+ * last.  A loop can only be on here once. */
+static UInt loop_stack[MAX_LOOPS];
+static UInt loop_depth          = 0;
+
+/* Telling when an inner loop is done.  Each shadowed block keeps a bit per
+ * loop whose body it's been seen in.  A nested loop learns its body during
+ * the first iteration it runs nested; after that, a shadowed block that's
+ * not in the innermost loop's body means we've left that loop, and its
+ * last iteration is reported then rather than at the outer header.  (So
+ * a path that the first iteration never took ends the loop early too, and
+ * the next header hit enters it again.)  The outermost loop is never left
+ * this way; stores after it are still charged to its last iteration. */
+#define LOOP_BIT(idx)   ((HWord)1 << (idx))
+
+typedef struct _loop_member
+{
+    struct _loop_member *next;
+    Addr                addr;
+    HWord               in_loops;
+}
+loop_member;
+
+static VgHashTable loop_member_ht = NULL;
+
+/* Read inline by shadowed blocks: the innermost loop's bit along with those
+ * of any nested loops still learning their bodies, or 0 outside of nested
+ * loops.  A block missing any of these bits calls left_loop_body. */
+static HWord loop_exit_watch    = 0;
+static HWord loop_learn_mask    = 0;
+
+static void update_loop_watch(void)
+{
+    UInt i;
+
+    loop_learn_mask = 0;
+    for (i = 1; i < loop_depth; i++)
+    {
+        if (!loops[loop_stack[i]].body_known)
+        {
+            loop_learn_mask |= LOOP_BIT(loop_stack[i]);
+        }
+    }
+
+    loop_exit_watch = loop_depth > 1 ? 
+        loop_learn_mask | LOOP_BIT(loop_stack[loop_depth - 1]) : 0;
+}
+
+/* Callback for a shadowed block that's not (yet) in all the loop bodies
+ * it's being watched for. */
+static void left_loop_body(HWord member)
+{
+    loop_member *m = (loop_member *)member;
+
+    m->in_loops |= loop_learn_mask;
+
+    while (loop_depth > 1 && 
+            !(m->in_loops & LOOP_BIT(loop_stack[loop_depth - 1])))
+    {
+        print_and_reset_shadow_mem(&loops[loop_stack[--loop_depth]]);
+    }
+
+    update_loop_watch();
+    global_shadow_table = loops[loop_stack[loop_depth - 1]].shadow;
+}
+
+/* Emit a call to left_loop_body at the top of the shadowed block at addr,
+ * guarded on (in_loops & loop_exit_watch) != loop_exit_watch. */
+static void add_loop_exit_check(IRSB *bb, Addr addr, IRType hWordTy)
+{
+    Bool is64 = (hWordTy == Ity_I64);
+    loop_member *m = VG_(HT_lookup)(loop_member_ht, addr);
+    IRTemp watch, in_loops, t;
+    IRDirty *di;
+
+    if (!m)
+    {
+        m = VG_(malloc)("loop_member", sizeof(loop_member));
+        m->addr = addr;
+        m->in_loops = 0;
+        VG_(HT_add_node)(loop_member_ht, (VgHashNode*)m);
+    }
+
+    watch = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy, 
+                mkIRExpr_HWord( (HWord)&loop_exit_watch )));
+    in_loops = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy, 
+                mkIRExpr_HWord( (HWord)&m->in_loops )));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(is64 ? Iop_And64 : Iop_And32,
+                IRExpr_RdTmp(in_loops), IRExpr_RdTmp(watch)));
+    t = assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(is64 ? Iop_CmpNE64 : Iop_CmpNE32,
+                IRExpr_RdTmp(t), IRExpr_RdTmp(watch)));
+
+    di = unsafeIRDirty_0_N(
+            0, "left_loop_body",
+            VG_(fnptr_to_fnentry)( &left_loop_body ),
+            mkIRExprVec_1( mkIRExpr_HWord((HWord)m) ));
+    di->guard = IRExpr_RdTmp(t);
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
+
+/* Callback for the top of loop header idx.  If we're not in that loop
+ * yet, we are now.  If we are, whatever loops we were in inside of it have
+ * finished (so report their last go around), and it's done another
+ * iteration.  Either way, stores from here on belong to it. */
+static void loop_header_hit(HWord idx)
+{
+    loop_info *l = &loops[idx];
+    UInt i;
+
+    if (clo_loop_body_only)
+    {
+        commit_loop_blocks();
+    }
+
+    for (i = loop_depth; i > 0 && loop_stack[i - 1] != idx; i--) 
+        ;
+
+    if (i == 0)
+    {
+        tl_assert(loop_depth < MAX_LOOPS);
+        loop_stack[loop_depth++] = idx;
+        l->entries++;
+
+        /* Stores before the first loop don't belong to any iteration, so
+         * nothing was translated to shadow them */
+        if (loop_depth == 1)
+        {
+            discard_tracked_translations();
+        }
+
+        if (clo_shadow_mode == SHADOW_SNAPSHOT && shadowing)
+        {
+            snapshot_take_regions(l->snaps);
+        }
+    }
+    else
+    {
+        while (loop_depth > i)
+        {
+            print_and_reset_shadow_mem(&loops[loop_stack[--loop_depth]]);
+        }
+
+        /* Nested, it's been watching its body go by since it came in */
+        if (i > 1)
+        {
+            l->body_known = True;
+        }
+
+        l->iterations++;
+        print_and_reset_shadow_mem(l);
+    }
+
+    update_loop_watch();
+    global_shadow_table = l->shadow;
+}
+
+/* LOOPGRIND_START/STOP_SHADOWING.  The stores of the iterations we're in
+ * the middle of are only half there either way, so they go. */
+static void set_shadowing(Bool on)
+{
+    Int i;
+
+    if (shadowing == on) return;
+
+    shadowing = on;
+    for (i = 0; i < n_loops; i++)
+    {
+        reset_shadow_table(loops[i].shadow);
+        snapshot_forget_regions(loops[i].snaps);
+    }
+
+    discard_tracked_translations();
+}
+
+/* LOOPGRIND_MARK_ITERATION: a loop header the program tells us about,
+ * named by id instead of found by address. */
+static void mark_iteration(Addr id)
+{
+    Int i;
+
+    for (i = 0; i < n_loops && loops[i].addr != id; i++)
+        ;
+
+    if (i == n_loops)
+    {
+        if (n_loops == MAX_LOOPS)
+        {
+            VG_(umsg)("can't mark loop 0x%lx: too many loops (max %d)\n", 
+                    id, MAX_LOOPS);
+            return;
+        }
+
+        /* The program knows better than --loop-addr=auto would */
+        clo_find_loop = False;
+
+        loops[n_loops].addr = id;
+        loops[n_loops].shadow = new_shadow_table();
+        loops[n_loops].snaps = snapshot_new_copies();
+        n_loops++;
+    }
+
+    loop_header_hit(i);
+}
+
+
+
+/* Record a store; the _hi halves are only for V128. */
+static void log_store(Addr addr, IRType type, ULong oldval_hi, ULong oldval,
+        ULong newval_hi, ULong newval)
+{
+    shadow_table *t = global_shadow_table;
+    shadow_record *r;
+
+    tl_assert(addr);
+    tl_assert(type != Ity_INVALID);
+
+
+    r = get_shadow_record(t, addr);
+
+    /* Runs of adjacent stores (memcpy, strcpy and friends) get one range
+     * record between them instead of one record apiece, whatever width
+     * they're done at.  A store into the middle of a range is already
+     * covered. */
+    if (!r)
+    {
+        if (is_shadow_dirty(t, addr) ||
+                extend_shadow_range(t, addr, type, oldval_hi, oldval))
+        {
+            return;
+        }
+
+        r = add_shadow_record(t, addr);
+        r->type = type;
+        r->oldval = oldval;
+        r->oldval_hi = oldval_hi;
+        t->last_run = r;
+    }
+
+    r->newval = newval;
+    r->newval_hi = newval_hi;
+}
+
+/* Record a store of up to 64 bits; values are zero-extended. */
+static void log_shadow_write(Addr addr, IRType type, ULong oldval, ULong newval) 
+{
+    log_store(addr, type, 0, oldval, 0, newval);
+}
+
+/* Record a 128-bit (V128) store. */
+static void log_shadow_write_128(Addr addr, IRType type, 
+        ULong oldval_hi, ULong oldval, ULong newval_hi, ULong newval) 
+{
+    log_store(addr, type, oldval_hi, oldval, newval_hi, newval);
+}
+
+
+/* Emit IR to find the shadow_page for addr through the shadow table's
+ * primary map, returning a temp holding its address.  A miss in the
+ * primary map gives no_page, which looks clean, so whichever helper the
+ * caller guards on that will go and sort it out. */
+static IRTemp add_shadow_page_lookup(IRSB *bb, IRExpr *addr, IRType hWordTy)
+{
+    Bool is64 = (hWordTy == Ity_I64);
+    IROp opAdd = is64 ? Iop_Add64 : Iop_Add32;
+    IRTemp key, t, primary, entry, entry_key, entry_page, hit;
+
+    /* Which page is it, and is the primary map holding it? */
+    key = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(is64 ? Iop_Shr64 : Iop_Shr32, deepCopyIRExpr(addr), 
+                IRExpr_Const(IRConst_U8(SHADOW_PAGE_BITS))));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(is64 ? Iop_And64 : Iop_And32, IRExpr_RdTmp(key), 
+                mkIRExpr_HWord(SHADOW_PM_SIZE - 1)));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(is64 ? Iop_Mul64 : Iop_Mul32, IRExpr_RdTmp(t), 
+                mkIRExpr_HWord(sizeof(shadow_pm_entry))));
+
+    /* Which table is in use changes as we go in and out of loops */
+    primary = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy,
+                mkIRExpr_HWord( (HWord)&global_shadow_table )));
+    primary = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opAdd, IRExpr_RdTmp(primary), 
+                mkIRExpr_HWord(offsetof(shadow_table, primary))));
+    primary = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy, IRExpr_RdTmp(primary)));
+    entry = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opAdd, IRExpr_RdTmp(t), IRExpr_RdTmp(primary)));
+    entry_key = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy, IRExpr_RdTmp(entry)));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opAdd, IRExpr_RdTmp(entry), 
+                mkIRExpr_HWord(offsetof(shadow_pm_entry, page))));
+    entry_page = assign_new_temp(bb, hWordTy,
+            IRExpr_Load(False, Iend_LE, hWordTy, IRExpr_RdTmp(t)));
+    t = assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(is64 ? Iop_CmpEQ64 : Iop_CmpEQ32, 
+                IRExpr_RdTmp(entry_key), IRExpr_RdTmp(key)));
+    hit = assign_new_temp(bb, Ity_I8, 
+            IRExpr_Unop(Iop_1Uto8, IRExpr_RdTmp(t)));
+    return assign_new_temp(bb, hWordTy,
+            IRExpr_Mux0X(IRExpr_RdTmp(hit),
+                mkIRExpr_HWord( (HWord)global_shadow_table->no_page ),
+                IRExpr_RdTmp(entry_page)));
+}
+
+/* Emit IR for the shadow table's dirty-bit test (see shadow_page), and
+ * return an Ity_I1 temp that's true if nothing has been stored at addr yet
+ * this iteration. */
+static IRTemp add_shadow_dirty_check(IRSB *bb, IRExpr *addr, IRType hWordTy)
+{
+    Bool is64 = (hWordTy == Ity_I64);
+    IROp opAdd = is64 ? Iop_Add64 : Iop_Add32;
+    IROp opAnd = is64 ? Iop_And64 : Iop_And32;
+    IROp opShr = is64 ? Iop_Shr64 : Iop_Shr32;
+    IRTemp t, page, byte_addr, byte, bit;
+
+    page = add_shadow_page_lookup(bb, addr, hWordTy);
+
+    /* Find its bit */
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opAnd, deepCopyIRExpr(addr), 
+                mkIRExpr_HWord(SHADOW_PAGE_SIZE - 1)));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opShr, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U8(3))));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opAdd, IRExpr_RdTmp(page), IRExpr_RdTmp(t)));
+    byte_addr = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opAdd, IRExpr_RdTmp(t), 
+                mkIRExpr_HWord(offsetof(shadow_page, dirty))));
+    t = assign_new_temp(bb, Ity_I8,
+            IRExpr_Load(False, Iend_LE, Ity_I8, IRExpr_RdTmp(byte_addr)));
+    byte = assign_new_temp(bb, Ity_I32,
+            IRExpr_Unop(Iop_8Uto32, IRExpr_RdTmp(t)));
+    t = assign_new_temp(bb, Ity_I8,
+            IRExpr_Unop(is64 ? Iop_64to8 : Iop_32to8, deepCopyIRExpr(addr)));
+    bit = assign_new_temp(bb, Ity_I8,
+            IRExpr_Binop(Iop_And8, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U8(7))));
+    t = assign_new_temp(bb, Ity_I32,
+            IRExpr_Binop(Iop_Shr32, IRExpr_RdTmp(byte), IRExpr_RdTmp(bit)));
+    t = assign_new_temp(bb, Ity_I32,
+            IRExpr_Binop(Iop_And32, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U32(1))));
+
+    return assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(Iop_CmpEQ32, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U32(0))));
+}
+
+
+/* The top of the running thread's stack, for add_stack_check.  Only the
+ * main thread's stack is above everything else; other threads' are down
+ * among the mmaps, with library data and heap above them. */
+static Addr curr_stack_max      = ~(Addr)0;
+
+/* Emit IR to check the address of a store against the guest's stack
+ * pointer, as of that point in the block, and return an Ity_I1 temp that's
+ * true if it's not a stack store we were told to ignore.  Returns
+ * IRTemp_INVALID if we're not ignoring any. */
+static IRTemp add_stack_check(IRSB *bb, IRExpr *addr, 
+        VexGuestLayout *layout, IRType gWordTy)
+{
+    Bool is64 = (gWordTy == Ity_I64);
+    IROp sub = is64 ? Iop_Sub64 : Iop_Sub32;
+    IRTemp sp, lo, max, t, limit;
+
+    if (!clo_ignore_stack_writes)
+    {
+        return IRTemp_INVALID;
+    }
+
+    sp = assign_new_temp(bb, gWordTy, IRExpr_Get(layout->offset_SP, gWordTy));
+    lo = assign_new_temp(bb, gWordTy,
+            IRExpr_Binop(sub, IRExpr_RdTmp(sp), 
+                is64 ? IRExpr_Const(IRConst_U64(VG_STACK_REDZONE_SZB)) :
+                       IRExpr_Const(IRConst_U32(VG_STACK_REDZONE_SZB))));
+    max = assign_new_temp(bb, gWordTy,
+            IRExpr_Load(False, Iend_LE, gWordTy, 
+                mkIRExpr_HWord( (HWord)&curr_stack_max )));
+
+    /* The stack is [lo, max), or just the bottom clo_stack_depth bytes of
+     * it above the red zone; off it is addr - lo >= its size, unsigned */
+    t = assign_new_temp(bb, gWordTy,
+            IRExpr_Binop(sub, deepCopyIRExpr(addr), IRExpr_RdTmp(lo)));
+    limit = assign_new_temp(bb, gWordTy,
+            IRExpr_Binop(sub, IRExpr_RdTmp(max), IRExpr_RdTmp(lo)));
+
+    if (clo_stack_depth)
+    {
+        ULong w = VG_STACK_REDZONE_SZB + clo_stack_depth;
+        IRExpr *window = is64 ? IRExpr_Const(IRConst_U64(w)) : 
+                                IRExpr_Const(IRConst_U32((UInt)w));
+        IRTemp smaller = assign_new_temp(bb, Ity_I1,
+                IRExpr_Binop(is64 ? Iop_CmpLT64U : Iop_CmpLT32U,
+                    window, IRExpr_RdTmp(limit)));
+
+        smaller = assign_new_temp(bb, Ity_I8,
+                IRExpr_Unop(Iop_1Uto8, IRExpr_RdTmp(smaller)));
+        limit = assign_new_temp(bb, gWordTy,
+                IRExpr_Mux0X(IRExpr_RdTmp(smaller), 
+                    IRExpr_RdTmp(limit), deepCopyIRExpr(window)));
+    }
+
+    return assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(is64 ? Iop_CmpLE64U : Iop_CmpLE32U, 
+                IRExpr_RdTmp(limit), IRExpr_RdTmp(t)));
+}
+
+/* Emit IR for a && b, where both are Ity_I1 temps; b can be
+ * IRTemp_INVALID for "true". */
+static IRTemp add_guard_and(IRSB *bb, IRTemp a, IRTemp b)
+{
+    IRTemp a32, b32, t;
+
+    if (b == IRTemp_INVALID)
+    {
+        return a;
+    }
+
+    a32 = assign_new_temp(bb, Ity_I32, IRExpr_Unop(Iop_1Uto32, IRExpr_RdTmp(a)));
+    b32 = assign_new_temp(bb, Ity_I32, IRExpr_Unop(Iop_1Uto32, IRExpr_RdTmp(b)));
+    t = assign_new_temp(bb, Ity_I32,
+            IRExpr_Binop(Iop_And32, IRExpr_RdTmp(a32), IRExpr_RdTmp(b32)));
+
+    return assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(Iop_CmpNE32, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U32(0))));
+}
+
+
+/* Emit a call to log_shadow_write(_128) ahead of the store st, for the
+ * first store to its address in an iteration only, and only if off_stack
+ * (see add_stack_check) holds. */
+static void add_shadow_write(IRSB *bb, IRStmt *st, IRTemp off_stack, 
+        IRType hWordTy)
+{
+    IRExpr *addr = st->Ist.Store.addr;
+    IRType ty = typeOfIRExpr(bb->tyenv, st->Ist.Store.data);
+    IRTemp oldval, old_lo, old_hi, new_lo, new_hi;
+    IRDirty *di;
+
+    /* Get the current value at the address we're overwriting, at the full
+     * width of the store */
+    oldval = assign_new_temp(bb, ty, 
+            IRExpr_Load(False, st->Ist.Store.end, ty, deepCopyIRExpr(addr)));
+    widen_expr_to_64_bits(bb, IRExpr_RdTmp(oldval), &old_lo, &old_hi);
+
+    /* Get new value that we will write */
+    widen_expr_to_64_bits(bb, st->Ist.Store.data, &new_lo, &new_hi);
+
+    if (old_hi == IRTemp_INVALID)
+    {
+        di = unsafeIRDirty_0_N(0 /* regparm */,
+                "log_shadow_write",
+                VG_(fnptr_to_fnentry)(log_shadow_write),
+                mkIRExprVec_4(
+                    deepCopyIRExpr(addr), 
+                    mkIRExpr_HWord(ty),
+                    IRExpr_RdTmp(old_lo),
+                    IRExpr_RdTmp(new_lo)));
+    }
+    else
+    {
+        di = unsafeIRDirty_0_N(0 /* regparm */,
+                "log_shadow_write_128",
+                VG_(fnptr_to_fnentry)(log_shadow_write_128),
+                mkIRExprVec_6(
+                    deepCopyIRExpr(addr), 
+                    mkIRExpr_HWord(ty),
+                    IRExpr_RdTmp(old_hi),
+                    IRExpr_RdTmp(old_lo),
+                    IRExpr_RdTmp(new_hi),
+                    IRExpr_RdTmp(new_lo)));
+    }
+
+    di->guard = IRExpr_RdTmp(
+            add_guard_and(bb, add_shadow_dirty_check(bb, addr, hWordTy), 
+                off_stack));
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
+
+
+
+/* SHADOW_PAGES: keep a copy of the page around addr as it was before this
+ * iteration first stored to it. */
+static void copy_shadow_page(Addr addr)
+{
+    shadow_page *page = get_dirty_shadow_page(global_shadow_table, addr);
+    Addr base = addr & ~(Addr)(SHADOW_PAGE_SIZE - 1);
+
+    if (page->page_dirty) return;
+
+    if (!VG_(am_is_valid_for_client)(base, SHADOW_PAGE_SIZE, VKI_PROT_READ))
+    {
+        return;
+    }
+
+    if (!page->snap)
+    {
+        page->snap = VG_(malloc)("shadow_page.snap", SHADOW_PAGE_SIZE);
+    }
+    VG_(memcpy)(page->snap, (void *)base, SHADOW_PAGE_SIZE);
+    page->page_dirty = 1;
+}
+
+/* Callback for a store to a page nobody's stored to yet this iteration,
+ * or one that straddles two pages. */
+static void log_dirty_page(Addr addr, HWord size)
 {
-    IRExpr *wide_e;
-    IRTemp temp = newIRTemp(bb->tyenv, Ity_I32); /*This will break on x64 */
+    copy_shadow_page(addr);
+    copy_shadow_page(addr + size - 1);
+}
 
-    /* Widen e into a 64-bit (tree IR) value */
-    switch (typeOfIRExpr(bb->tyenv,e)) 
-    {
-        case Ity_F32:
-        case Ity_I32: wide_e = deepCopyIRExpr(e); break;
-        case Ity_I16: wide_e = IRExpr_Unop(Iop_16Uto32,e); break;
-        case Ity_I8:  wide_e = IRExpr_Unop(Iop_8Uto32,e); break;
-        default:  ppIRType(typeOfIRExpr(bb->tyenv,e)); 
-                  tl_assert2(0, "widen_expr_to_32_bits: unimplemented IRType conversion"); 
-    }
+/* Emit IR to call log_dirty_page ahead of the store st, but only if its
+ * page is still clean (and off_stack holds).  Everything else a store
+ * costs us is inline. */
+static void add_page_write(IRSB *bb, IRStmt *st, IRTemp off_stack, 
+        IRType hWordTy)
+{
+    Bool is64 = (hWordTy == Ity_I64);
+    IROp opShr = is64 ? Iop_Shr64 : Iop_Shr32;
+    IRExpr *addr = st->Ist.Store.addr;
+    Int size = sizeofIRType(typeOfIRExpr(bb->tyenv, st->Ist.Store.data));
+    IRTemp page, t, clean, first_key, last_key, crosses, guard;
+    IRDirty *di;
+
+    /* Is the page clean? */
+    page = add_shadow_page_lookup(bb, addr, hWordTy);
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(is64 ? Iop_Add64 : Iop_Add32, IRExpr_RdTmp(page), 
+                mkIRExpr_HWord(offsetof(shadow_page, page_dirty))));
+    t = assign_new_temp(bb, Ity_I8,
+            IRExpr_Load(False, Iend_LE, Ity_I8, IRExpr_RdTmp(t)));
+    t = assign_new_temp(bb, Ity_I32,
+            IRExpr_Unop(Iop_8Uto32, IRExpr_RdTmp(t)));
+    t = assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(Iop_CmpEQ32, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U32(0))));
+    clean = assign_new_temp(bb, Ity_I32, 
+            IRExpr_Unop(Iop_1Uto32, IRExpr_RdTmp(t)));
+
+    /* Does the store run over into the next page? */
+    first_key = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opShr, deepCopyIRExpr(addr), 
+                IRExpr_Const(IRConst_U8(SHADOW_PAGE_BITS))));
+    t = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(is64 ? Iop_Add64 : Iop_Add32, deepCopyIRExpr(addr), 
+                mkIRExpr_HWord(size - 1)));
+    last_key = assign_new_temp(bb, hWordTy,
+            IRExpr_Binop(opShr, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U8(SHADOW_PAGE_BITS))));
+    t = assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(is64 ? Iop_CmpNE64 : Iop_CmpNE32, 
+                IRExpr_RdTmp(first_key), IRExpr_RdTmp(last_key)));
+    crosses = assign_new_temp(bb, Ity_I32, 
+            IRExpr_Unop(Iop_1Uto32, IRExpr_RdTmp(t)));
+
+    t = assign_new_temp(bb, Ity_I32,
+            IRExpr_Binop(Iop_Or32, IRExpr_RdTmp(clean), IRExpr_RdTmp(crosses)));
+    guard = assign_new_temp(bb, Ity_I1,
+            IRExpr_Binop(Iop_CmpNE32, IRExpr_RdTmp(t), 
+                IRExpr_Const(IRConst_U32(0))));
+
+    di = unsafeIRDirty_0_N(0 /* regparm */,
+            "log_dirty_page",
+            VG_(fnptr_to_fnentry)(log_dirty_page),
+            mkIRExprVec_2(deepCopyIRExpr(addr), mkIRExpr_HWord(size)));
+    di->guard = IRExpr_RdTmp(add_guard_and(bb, guard, off_stack));
+    addStmtToIRSB(bb, IRStmt_Dirty(di));
+}
 
 
-    addStmtToIRSB(bb, IRStmt_WrTmp(temp, wide_e));
 
-    return temp;
-} 
+/******************************* Control file ********************************/
 
-/************** SB graph generation callback functions ************************/
+/* There's no gdbserver to hang monitor commands off of, so instead, like
+ * callgrind does for callgrind_control, we look for a file of commands
+ * whenever the scheduler starts running client code again (every timeslice,
+ * or when a thread comes back from a system call), at most once every
+ * CONTROL_POLL_MS.  That goes on whatever code the client is running, but a
+ * program blocked in a system call only answers once it wakes up.  If the
+ * file is there, we answer each line of it in the log and delete it:
+ *
+ *  blocks [n]      the n heaviest SBs (up to 100) [10]
+ *  edges [n]       the n heaviest edges [10]
+ *  loops           iterations so far of each loop, and which we're in
+ *  shadow          how big each loop's memory diff is so far this iteration
+ *  dump            dump the whole SB graph, as LOOPGRIND_DUMP() would
+ */
+#define CONTROL_POLL_MS     1000
+#define CONTROL_TOP_MAX     100
+#define CONTROL_CMD_MAX     1024
 
+static UInt control_last_ms     = 0;
 
-/* Callback when instrumented execution jumps to a new superblock */
-static void trace_superblock(Addr ebp, Addr key)
+/* Insert x into the descending top[0..*n), keeping at most max */
+static void control_top_insert(void **top, ULong *counts, UInt *n, UInt max,
+        void *x, ULong count)
 {
-    sb_record *node;
-    VgHashTable old_jump_targets; 
+    UInt i;
 
+    if (*n == max && (max == 0 || count <= counts[max - 1])) return;
 
-    /* Little trick: since we know the entry point of main() is the first
-     * one we'll see, if log_entry_ebp is unset, set it now. */
-    if (log_entry_ebp == 0)
+    if (*n < max) (*n)++;
+
+    for (i = *n - 1; i > 0 && counts[i - 1] < count; i--)
     {
-        log_entry_ebp = ebp;
+        top[i] = top[i - 1];
+        counts[i] = counts[i - 1];
     }
+    top[i] = x;
+    counts[i] = count;
+}
 
+static void control_top_blocks(UInt max)
+{
+    void *top[CONTROL_TOP_MAX];
+    ULong counts[CONTROL_TOP_MAX];
+    sb_record *r;
+    UInt i, n = 0;
 
-    tl_assert(key != 0);
-    tl_assert(ebp <= log_entry_ebp); /* stack down, heap up! */
-
+    if (clo_trace_mode == TRACE_BUFFERED)
+    {
+        flush_events();
+    }
 
-    /* Increment global superblock counter */
-    node = get_sb_record(global_bb_ht, key);
+    VG_(HT_ResetIter)(global_bb_ht);
+    while ((r = VG_(HT_Next)(global_bb_ht)) != NULL)
+    {
+        control_top_insert(top, counts, &n, max, r, r->count);
+    }
 
-    if (!node)
+    VG_(umsg)("lg> top %u of %d blocks:\n", n, 
+            VG_(HT_count_nodes)(global_bb_ht));
+    for (i = 0; i < n; i++)
     {
-        node = add_sb_record(global_bb_ht, key);
+        r = top[i];
+        VG_(umsg)("lg>   0x%08lx %llu%s%s\n", r->addr, r->count,
+                r->fn_name ? " " : "", r->fn_name ? r->fn_name : "");
     }
+}
 
-    node->count += calculate_weight(ebp);
+static void control_top_edges(UInt max)
+{
+    void *top[CONTROL_TOP_MAX];
+    ULong counts[CONTROL_TOP_MAX];
+    edge_record *e;
+    UInt i, n = 0;
 
-    if (clo_debug_mode)
+    if (clo_trace_mode == TRACE_BUFFERED)
     {
-        VG_(printf)("EBP %p\n", log_entry_ebp - ebp);
-        VG_(printf)("SB %08lx: (%lu)\n", node->addr, node->count);
+        flush_events();
     }
 
+    for (i = 0; i < global_edge_table->n_entries; i++)
+    {
+        e = &global_edge_table->entries[i];
+        control_top_insert(top, counts, &n, max, e, e->count);
+    }
 
-    /* Increment jump target count in current superblock */
-    node = get_sb_record(global_bb_ht, curr_bb_addr);
+    VG_(umsg)("lg> top %u of %u edges:\n", n, global_edge_table->n_entries);
+    for (i = 0; i < n; i++)
+    {
+        e = top[i];
+        VG_(umsg)("lg>   0x%08lx -> 0x%08lx %llu\n", e->src, e->dst, e->count);
+    }
+}
 
-    /* If we don't have the current sb hashed, there's something fishy */
-    tl_assert(node);
+static void control_loops(void)
+{
+    Int i;
+    UInt j;
 
-    old_jump_targets = node->jump_targets;
-    node = get_sb_record(old_jump_targets, key);
-    if (!node)
+    if (n_loops == 0)
     {
-        node = add_sb_record(old_jump_targets, key);
+        VG_(umsg)("lg> no loops%s\n", clo_find_loop ? " found yet" : "");
+        return;
     }
 
-    node->count += calculate_weight(ebp);
+    for (i = 0; i < n_loops; i++)
+    {
+        for (j = 0; j < loop_depth && loop_stack[j] != (UInt)i; j++)
+            ;
 
-    if (clo_debug_mode)
-        VG_(printf)("JP %08lx -> %08lx (%lu)\n\n", 
-                curr_bb_addr,
-                node->addr,
-                node->count);
+        VG_(umsg)("lg> loop 0x%08lx: %llu iterations, %llu entries%s\n",
+                loops[i].addr, loops[i].iterations, loops[i].entries,
+                j < loop_depth ? ", in it" : "");
+    }
+}
 
-    curr_bb_addr = key;
+/* The diff is however many records (or pages) would get printed if the
+ * header were hit now. */
+static void control_shadow(void)
+{
+    Int i;
 
-}
+    if (!shadowing || clo_shadow_mode == SHADOW_SNAPSHOT)
+    {
+        VG_(umsg)("lg> not shadowing stores\n");
+        return;
+    }
 
+    for (i = 0; i < n_loops; i++)
+    {
+        shadow_table *t = loops[i].shadow;
+        shadow_page *page;
+        UInt n_pages = 0;
 
+        for (page = t->dirty_pages; page; page = page->next_dirty)
+        {
+            if (clo_shadow_mode == SHADOW_STORES || page->page_dirty)
+            {
+                n_pages++;
+            }
+        }
 
+        if (clo_shadow_mode == SHADOW_PAGES)
+        {
+            VG_(umsg)("lg> loop 0x%08lx: %u pages\n", loops[i].addr, n_pages);
+        }
+        else
+        {
+            VG_(umsg)("lg> loop 0x%08lx: %u records over %u pages\n", 
+                    loops[i].addr, t->n_used, n_pages);
+        }
+    }
+}
 
-/************************ Shadow memory functions ****************************/
+static void control_command(Char *cmd)
+{
+    Char *arg;
+    UInt n = 10;
 
+    while (VG_(isspace)(*cmd)) cmd++;
+    if (*cmd == '\0') return;
 
+    for (arg = cmd; *arg && !VG_(isspace)(*arg); arg++)
+        ;
+    if (*arg)
+    {
+        Long x;
 
+        *arg++ = '\0';
+        x = VG_(strtoll10)(arg, NULL);
+        if (x > 0)
+        {
+            n = (x > CONTROL_TOP_MAX) ? CONTROL_TOP_MAX : x;
+        }
+    }
 
+    if (VG_(strcmp)(cmd, "blocks") == 0)        control_top_blocks(n);
+    else if (VG_(strcmp)(cmd, "edges") == 0)    control_top_edges(n);
+    else if (VG_(strcmp)(cmd, "loops") == 0)    control_loops();
+    else if (VG_(strcmp)(cmd, "shadow") == 0)   control_shadow();
+    else if (VG_(strcmp)(cmd, "dump") == 0)     dump_now();
+    else
+    {
+        VG_(umsg)("lg> unknown command '%s' "
+                "(want blocks, edges, loops, shadow or dump)\n", cmd);
+    }
+}
 
-static void print_and_reset_shadow_mem(void)
+static void control_poll(void)
 {
-    shadow_record *r;
-
-        VG_(printf)(" *** Memory diff since last entry into %p ***\n", clo_loop_addr);
+    Char buf[CONTROL_CMD_MAX + 1];
+    Char *name, *line, *end;
+    SysRes sres;
+    Int len;
+
+    /* Every time, since the pid might not be the same as last time */
+    name = VG_(expand_file_name)("--control-file", clo_control_file);
+    sres = VG_(open)(name, VKI_O_RDONLY, 0);
+    if (sr_isError(sres))
+    {
+        VG_(free)(name);
+        return;
+    }
 
+    len = VG_(read)(sr_Res(sres), buf, CONTROL_CMD_MAX);
+    VG_(close)(sr_Res(sres));
+    VG_(unlink)(name);
+    VG_(free)(name);
 
-        VG_(HT_ResetIter)(shadow_table);
+    if (len <= 0) return;
+    buf[len] = '\0';
 
-        while ((r = VG_(HT_Next)(shadow_table)) != NULL)
+    for (line = buf; *line; line = end)
+    {
+        for (end = line; *end && *end != '\n'; end++)
+            ;
+        if (*end)
         {
-            pp_shadow_record(r);
+            *end++ = '\0';
         }
+        control_command(line);
+    }
+}
 
-        VG_(printf)(" ***\n");
 
 
 
-        /* Free up all memory in existing table */
-        VG_(HT_destruct)(shadow_table);
+/********************* Valgrind callback functions ***************************/
 
 
+/* Each time the scheduler gets going with client code again: a thread's
+ * stack for add_stack_check, and a poll of --control-file if it's time. */
+static void lg_start_client_code(ThreadId tid, ULong blocks_done)
+{
+    UInt now;
 
-    shadow_table = VG_(HT_construct)("shadow_table");
+    curr_stack_max = VG_(thread_get_stack_max)(tid);
 
-    tl_assert(shadow_table); 
+    if (!clo_control_file) return;
 
+    now = VG_(read_millisecond_timer)();
+    if (now - control_last_ms >= CONTROL_POLL_MS)
+    {
+        control_last_ms = now;
+        control_poll();
+    }
 }
 
-
-
-static void log_shadow_write(Addr addr, IRType type, Long oldval, Long newval) 
+/* A forked child starts out with a copy of the parent's SB graph, which the
+ * parent is going to report itself; the child only reports what it runs.
+ * Buffered events go into the parent's counts before the copy is made. */
+static void lg_pre_fork(ThreadId tid)
 {
-    shadow_record *r;
+    if (clo_trace_mode == TRACE_BUFFERED)
+    {
+        flush_events();
+    }
+}
 
-    tl_assert(addr);
-    tl_assert(type != Ity_INVALID);
+static void lg_child_fork(ThreadId tid)
+{
+    reset_sb_graph();
+}
 
+/* An object going away takes its code ranges with it; whatever gets mapped
+ * there next has to be looked at afresh.  dlclose unmaps from the load base,
+ * below the text, so this has to go by overlap rather than by a. */
+static void lg_die_mem_munmap(Addr a, SizeT len)
+{
+    Int i, j;
 
-    r = get_shadow_record(shadow_table, addr);
+    objmap_remove(a, len);
 
-    if (!r)
+    for (i = j = 0; i < n_excluded_objs; i++)
     {
-        r = add_shadow_record(shadow_table, addr);
-        r->type = type;
-        r->oldval = oldval;
-
-        /* Mask out high order bits if the size of the write is < 32 bits */
-        switch (r->type)
+        if (excluded_objs[i].end <= a || excluded_objs[i].start >= a + len)
         {
-            case Ity_I1:
-                r->oldval &= 0x1;
-                break;
-            case Ity_I8:
-                r->oldval &= 0xFF000000FF; /* wtffffff*/
-                break;
-            case Ity_I16:
-                r->oldval &= 0xFFFF;
-                break;
-            case Ity_I32:
-            case Ity_I64:
-            case Ity_I128:
-            case Ity_F32:
-            case Ity_F64:
-            case Ity_V128:
-            case Ity_INVALID:
-                break;
+            excluded_objs[j++] = excluded_objs[i];
         }
     }
-
-    r->newval = newval;
+    n_excluded_objs = j;
 }
 
 
 
-/********************* Valgrind callback functions ***************************/
-
-
-
 
 /* Where the magic happens. */
 static IRSB* lg_instrument ( VgCallbackClosure* closure,
@@ -349,8 +2382,9 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
         VexGuestExtents* vge,
         IRType gWordTy, IRType hWordTy )
 {
-    int i = 0;
+    int i = 0, j;
     char fnname[128];
+    Bool instrument, shadow;
     IRSB *sbOut;
 
     /* Set up SB reamble */
@@ -370,17 +2404,50 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
 
 
 
-    /* Start logging again if we've coming up from being under main */
-    if (log_entry_addr && 
-            !logging && first_stmt->Ist.IMark.addr >= TEXT_SEG_BEGIN)
+    /* We are interested in enabling logging if we've found main;
+     * conversely, disable logging if we've exited out of main().  Do this
+     * before anything else so the whole block agrees on what it is. */
+    for (j = i; j < sbIn->stmts_used; j++)
     {
-        start_logging();
+        IRStmt *st = sbIn->stmts[j];
+
+        if (st->tag == Ist_IMark && 
+                VG_(get_fnname_if_entry)(
+                    st->Ist.IMark.addr,
+                    fnname,
+                    sizeof(fnname))) 
+        {
+            if (VG_(strcmp)(fnname, log_entry_fnname) == 0) 
+            {
+                process_main_SB((Addr)st->Ist.IMark.addr);
+            }
+            else if (VG_(strcmp)(fnname, log_exit_fnname) == 0)
+            {
+                process_exit_SB((Addr)st->Ist.IMark.addr);
+            } 
+        }
     }
-    /* If we've jumped to some loaded library, assume that we're
-     * in libc somewhere and stop instrumenting until we get back out */
-    if (logging && first_stmt->Ist.IMark.addr < TEXT_SEG_BEGIN)
+
+    /* Library code (and everything outside of main()) gets no
+     * instrumentation whatsoever */
+    instrument = should_instrument(vge->base[0]);
+
+    /* Likewise, only shadow stores in the loop body, if asked to.  A block
+     * that's not in it yet (and has stores) tells us when it runs. */
+    shadow = instrument && shadowing && loop_depth && 
+        clo_shadow_mode != SHADOW_SNAPSHOT;
+    if (shadow && clo_loop_body_only && !in_loop_body(vge->base[0]))
     {
-        stop_logging();
+        shadow = False;
+
+        for (j = i; j < sbIn->stmts_used; j++)
+        {
+            if (sbIn->stmts[j]->tag == Ist_Store)
+            {
+                add_loop_block_note(sbOut, vge->base[0], hWordTy);
+                break;
+            }
+        }
     }
 
 
@@ -388,16 +2455,25 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
     /*******
      * Shadow memory stuff
      ******/
-//    VG_(printf)("first_stmt->Ist.IMark.addr = %p clo_loop_addr = %p\n", 
-//            (Addr)first_stmt->Ist.IMark.addr, clo_loop_addr);
 
-    if ((Addr)first_stmt->Ist.IMark.addr == clo_loop_addr)
+    /* Before the header call, so that a header block is learned into its
+     * own loop's body before that loop's body counts as known */
+    if (shadow)
     {
-        IRDirty *di = unsafeIRDirty_0_N(
-                0, "print_and_reset_shadow_mem",
-                VG_(fnptr_to_fnentry)( &print_and_reset_shadow_mem ),
-                mkIRExprVec_0());
-        addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+        add_loop_exit_check(sbOut, vge->base[0], hWordTy);
+    }
+
+    for (j = 0; j < n_loops; j++)
+    {
+        if ((Addr)first_stmt->Ist.IMark.addr == loops[j].addr)
+        {
+            IRDirty *di = unsafeIRDirty_0_N(
+                    0, "loop_header_hit",
+                    VG_(fnptr_to_fnentry)( &loop_header_hit ),
+                    mkIRExprVec_1( mkIRExpr_HWord(j) ));
+            addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+            break;
+        }
     }
 
 
@@ -407,8 +2483,29 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
      * SB graph generation stuff
      ******/
 
+    /* Dump first, so that a dump never catches this block half-counted */
+    if (instrument && clo_dump_every)
+    {
+        add_dump_countdown(sbOut);
+    }
+
     /* Instrument this block! */
-    if (logging)
+    if (instrument && clo_trace_mode == TRACE_INLINE)
+    {
+        add_entry_increment(sbOut, vge->base[0], hWordTy);
+    }
+    else if (instrument && clo_trace_mode == TRACE_BUFFERED)
+    {
+        IRTemp temp = newIRTemp(sbOut->tyenv, gWordTy);
+        addStmtToIRSB(
+                sbOut,
+                IRStmt_WrTmp(
+                    temp,
+                    IRExpr_Get(layout->offset_FP, gWordTy)));
+
+        add_event_append(sbOut, vge->base[0], temp, hWordTy);
+    }
+    else if (instrument)
     {
         /* Construct a temporary to extract out the frame pointer */
         IRTemp temp = newIRTemp(sbOut->tyenv, gWordTy);
@@ -418,11 +2515,28 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
                     temp,
                     IRExpr_Get(layout->offset_FP, gWordTy)));
 
-        IRDirty *di = unsafeIRDirty_0_N(
-                0, "trace_superblock",
-                VG_(fnptr_to_fnentry)( &trace_superblock ),
-                mkIRExprVec_2(  IRExpr_RdTmp(temp),
-                    mkIRExpr_HWord( vge->base[0] )) );
+        IRDirty *di;
+
+        if (clo_sample_period)
+        {
+            IRTemp sampling = add_countdown(sbOut, &sample_countdown, 
+                    clo_sample_burst);
+
+            di = unsafeIRDirty_0_N(
+                    0, "trace_sampled_superblock",
+                    VG_(fnptr_to_fnentry)( &trace_sampled_superblock ),
+                    mkIRExprVec_2(  IRExpr_RdTmp(temp),
+                        mkIRExpr_HWord( vge->base[0] )) );
+            di->guard = IRExpr_RdTmp(sampling);
+        }
+        else
+        {
+            di = unsafeIRDirty_0_N(
+                    0, "trace_superblock",
+                    VG_(fnptr_to_fnentry)( &trace_superblock ),
+                    mkIRExprVec_2(  IRExpr_RdTmp(temp),
+                        mkIRExpr_HWord( vge->base[0] )) );
+        }
 
         /* Set annotations indicating that we want the frame pointer */
         di->nFxState = 1;
@@ -447,63 +2561,38 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
         switch (curr_stmt->tag)
         {
             case Ist_IMark:    
-                /* We are interested in enabling logging if we've found main;
-                 * conversely, disable logging if we've exited out of main(). */
-                if (VG_(get_fnname_if_entry)(
-                            curr_stmt->Ist.IMark.addr,
-                            fnname,
-                            sizeof(fnname))) 
-                {
-
-                    if (VG_(strcmp)(fnname, log_entry_fnname) == 0) 
-                    {
-                        process_main_SB(sbIn);
-                    }
-                    else if (VG_(strcmp)(fnname, log_exit_fnname) == 0)
-                    {
-                        process_exit_SB(sbIn);
-                    } 
-
-                }//if
                 addStmtToIRSB(sbOut, curr_stmt);
                 break; //IMark
 
             case Ist_Store:
-                if (logging && clo_loop_addr)
+                if (shadow && clo_shadow_mode == SHADOW_STORES)
                 {
-                    IRExpr **argv;
-                    IRDirty *di;
-                    IRTemp oldval, newval;
-
-                    /* Get the current value at the address we're overwriting */
-                    oldval = newIRTemp(sbOut->tyenv, gWordTy);
-                    addStmtToIRSB(sbOut, 
-                            IRStmt_WrTmp(   oldval, 
-                                IRExpr_Load(False,
-                                    Iend_LE,
-                                    Ity_I32,
-                                    curr_stmt->Ist.Store.addr)));
-
-
-                    /* Get new value that we will write */
-                    newval = widen_expr_to_32_bits(sbOut, curr_stmt->Ist.Store.data);
-
-                    argv = mkIRExprVec_4(
-                            curr_stmt->Ist.Store.addr, 
-                            mkIRExpr_HWord(typeOfIRExpr(sbIn->tyenv,curr_stmt->Ist.Store.data)),
-                            IRExpr_RdTmp(oldval),
-                            IRExpr_RdTmp(newval));
-
-                    di = unsafeIRDirty_0_N(0 /* regparm */,
-                            "log_shadow_write",
-                            VG_(fnptr_to_fnentry)(log_shadow_write),
-                            argv);
+                    add_shadow_write(sbOut, curr_stmt, 
+                            add_stack_check(sbOut, curr_stmt->Ist.Store.addr,
+                                layout, gWordTy),
+                            hWordTy);
+                }
+                else if (shadow && clo_shadow_mode == SHADOW_PAGES)
+                {
+                    add_page_write(sbOut, curr_stmt, 
+                            add_stack_check(sbOut, curr_stmt->Ist.Store.addr,
+                                layout, gWordTy),
+                            hWordTy);
+                }
+                addStmtToIRSB(sbOut, curr_stmt);
+                break; //Store
 
-                    addStmtToIRSB(sbOut, IRStmt_Dirty(di));
 
+            case Ist_Exit:
+                if (instrument && clo_trace_mode == TRACE_INLINE &&
+                        curr_stmt->Ist.Exit.jk == Ijk_Boring)
+                {
+                    add_edge_increment(sbOut, vge->base[0], 
+                            const_to_addr(curr_stmt->Ist.Exit.dst),
+                            curr_stmt->Ist.Exit.guard, hWordTy);
                 }
                 addStmtToIRSB(sbOut, curr_stmt);
-                break; //Store
+                break; //Exit
 
 
             case Ist_NoOp:
@@ -514,7 +2603,6 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
             case Ist_WrTmp:
             case Ist_Dirty:
             case Ist_CAS:
-            case Ist_Exit:
                 addStmtToIRSB(sbOut, curr_stmt);
                 break;
 
@@ -529,6 +2617,11 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
     /* The last statement should be an IRStmt_Exit containing the
      * branch instruction. */
 
+    if (instrument && clo_trace_mode == TRACE_INLINE)
+    {
+        add_exit_increment(sbOut, vge->base[0], sbIn->next, hWordTy);
+    }
+
     return sbOut;
 }
 
@@ -537,8 +2630,89 @@ static IRSB* lg_instrument ( VgCallbackClosure* closure,
 
 static Bool lg_process_cmd_line_option(Char *arg)
 {
+    Char *watch_spec;
+    Char *dump_spec;
+    Addr loop_addr;
+
     if      VG_BOOL_CLO(arg, "--debug",         clo_debug_mode) {}
-    else if VG_BHEX_CLO(arg, "--loop-addr", clo_loop_addr, TEXT_SEG_BEGIN, HEAP_SEG_END) {}
+    else if VG_XACT_CLO(arg, "--loop-addr=auto", clo_find_loop, True) {}
+    else if VG_BINT_CLO(arg, "--find-loop-threshold", clo_find_loop_threshold, 
+                        1, 0x7fffffff) {}
+    else if VG_BINT_CLO(arg, "--find-loop-min-body", clo_find_loop_min_body, 
+                        0, 0x7fffffff) {}
+    else if VG_BHEX_CLO(arg, "--loop-addr", loop_addr, MIN_USER_ADDR, MAX_USER_ADDR)
+    {
+        if (n_loops == MAX_LOOPS)
+        {
+            VG_(umsg)("too many --loop-addr options (max %d)\n", MAX_LOOPS);
+            VG_(exit)(1);
+        }
+        loops[n_loops++].addr = loop_addr;
+    }
+    else if VG_BOOL_CLO(arg, "--stats",         clo_stats) {}
+    else if VG_STR_CLO(arg, "--dump-every",     dump_spec)
+    {
+        Char *end;
+        Long n = VG_(strtoll10)(dump_spec, &end);
+
+        clo_dump_seconds = (*end == 's');
+        if (clo_dump_seconds) end++;
+
+        /* Seconds get turned into ms in a UInt */
+        if (end == dump_spec || *end != '\0' || n < 0 || 
+                n > (clo_dump_seconds ? 0x3fffff : 0x7fffffff))
+        {
+            VG_(umsg)("bad --dump-every '%s' (want <blocks> or <secs>s)\n",
+                    dump_spec);
+            VG_(exit)(1);
+        }
+        clo_dump_every = n;
+    }
+    else if VG_BOOL_CLO(arg, "--dump-reset",    clo_dump_reset) {}
+    else if VG_STR_CLO(arg, "--control-file",   clo_control_file) {}
+    else if VG_BOOL_CLO(arg, "--trace-atstart", clo_trace_atstart) {}
+    else if VG_BOOL_CLO(arg, "--shadow-atstart", clo_shadow_atstart) {}
+    else if VG_XACT_CLO(arg, "--output-format=text",   clo_binary_output, False) {}
+    else if VG_XACT_CLO(arg, "--output-format=binary", clo_binary_output, True) {}
+    else if VG_BINT_CLO(arg, "--out-fd",        clo_out_fd, 0, 1024) {}
+    else if VG_STR_CLO(arg, "--out-file",       clo_out_file) {}
+    else if VG_STR_CLO(arg, "--include-obj",    clo_include_objs[n_include_objs])
+    {
+        if (++n_include_objs == MAX_INCLUDE_OBJS)
+        {
+            VG_(umsg)("too many --include-obj options (max %d)\n",
+                    MAX_INCLUDE_OBJS - 1);
+            VG_(exit)(1);
+        }
+    }
+    else if VG_STR_CLO(arg, "--watch",          watch_spec)
+    {
+        if (!snapshot_add_region(watch_spec))
+        {
+            VG_(umsg)("bad --watch region '%s' (want <addr>:<len>)\n", 
+                    watch_spec);
+            VG_(exit)(1);
+        }
+    }
+    else if VG_BOOL_CLO(arg, "--loop-body-only", clo_loop_body_only) {}
+    else if VG_BOOL_CLO(arg, "--ignore-stack-writes", clo_ignore_stack_writes) {}
+    else if VG_BINT_CLO(arg, "--ignore-stack-depth", clo_stack_depth, 0, 0x10000000) {}
+    else if VG_XACT_CLO(arg, "--shadow-mode=stores",   clo_shadow_mode, SHADOW_STORES) {}
+    else if VG_XACT_CLO(arg, "--shadow-mode=pages",    clo_shadow_mode, SHADOW_PAGES) {}
+    else if VG_XACT_CLO(arg, "--shadow-mode=snapshot", clo_shadow_mode, SHADOW_SNAPSHOT) {}
+    else if VG_XACT_CLO(arg, "--weight-model=exp",    clo_weight_model, WEIGHT_EXP) {}
+    else if VG_XACT_CLO(arg, "--weight-model=linear", clo_weight_model, WEIGHT_LINEAR) {}
+    else if VG_XACT_CLO(arg, "--weight-model=step",   clo_weight_model, WEIGHT_STEP) {}
+    else if VG_XACT_CLO(arg, "--weight-model=raw",    clo_weight_model, WEIGHT_RAW) {}
+    else if VG_BINT_CLO(arg, "--sample-period", clo_sample_period, 0, 0x7fffffff) {}
+    else if VG_BINT_CLO(arg, "--sample-burst",  clo_sample_burst, 2, 0x7fffffff) {}
+    else if VG_BINT_CLO(arg, "--weight-decay",  clo_weight_decay, 1, 0x100000) {}
+    else if VG_BINT_CLO(arg, "--weight-cutoff", clo_weight_cutoff, 0, 0x100000) {}
+    else if VG_XACT_CLO(arg, "--trace-mode=dirty",  clo_trace_mode, TRACE_DIRTY) {}
+    else if VG_XACT_CLO(arg, "--trace-mode=inline", clo_trace_mode, TRACE_INLINE) {}
+    else if VG_XACT_CLO(arg, "--trace-mode=buffered", clo_trace_mode, TRACE_BUFFERED) {}
+    else if VG_BINT_CLO(arg, "--event-buffer-size", clo_event_buffer_size, 
+                        1024, 1 << 24) {}
 
     else return False;
 
@@ -548,7 +2722,55 @@ static Bool lg_process_cmd_line_option(Char *arg)
 static void lg_print_usage(void)
 {
     VG_(printf)("\t--debug=no|yes             Verbose mode\n"
-            "\t--header-addr=<addr>       Specify a priori header start for analysis\n");
+            "\t--loop-addr=<addr>         Loop header to diff memory at; give more\n"
+            "\t                           than one for nested loops, or 'auto' to\n"
+            "\t                           find one while tracing (dirty mode only)\n"
+            "\t--find-loop-threshold=<n>  Back edges (weighted) into a header\n"
+            "\t                           before --loop-addr=auto takes it [1000]\n"
+            "\t--find-loop-min-body=<n>   ...and SBs per iteration, at least [16]\n"
+            "\t--trace-mode=dirty|inline|buffered\n"
+            "\t                           Count SB edges with a weighted helper call,\n"
+            "\t                           raw inline IR counters, or a buffer of\n"
+            "\t                           weighted hits aggregated in bulk [dirty]\n"
+            "\t--event-buffer-size=<n>    SB hits per buffered batch [65536]\n"
+            "\t--sample-period=<m>        Only trace a burst of SBs out of every <m>;\n"
+            "\t                           dirty mode only, 0 traces everything [0]\n"
+            "\t--sample-burst=<n>         Consecutive SBs traced per burst [1000]\n"
+            "\t--include-obj=<glob>       Also instrument shared objects whose soname\n"
+            "\t                           matches (libc and ld.so never are)\n"
+            "\t--shadow-mode=stores|pages|snapshot\n"
+            "\t                           Diff memory at the header by shadowing\n"
+            "\t                           stores, by comparing the pages stored to\n"
+            "\t                           with copies taken before the first store,\n"
+            "\t                           or by comparing --watch regions with the\n"
+            "\t                           last iteration's copy [stores]\n"
+            "\t--watch=<addr>:<len>       Region for --shadow-mode=snapshot\n"
+            "\t--trace-atstart=no|yes     Trace from main(), or wait for the program\n"
+            "\t                           to do LOOPGRIND_START_TRACING() [yes]\n"
+            "\t--shadow-atstart=no|yes    Likewise, LOOPGRIND_START_SHADOWING() [yes]\n"
+            "\t--loop-body-only=no|yes    Only shadow stores in blocks that run\n"
+            "\t                           between header hits [no]\n"
+            "\t--ignore-stack-writes=no|yes\n"
+            "\t                           Don't shadow stores to the stack [no]\n"
+            "\t--ignore-stack-depth=<n>   Only ignore those within <n> bytes above\n"
+            "\t                           the stack pointer, 0 for all [0]\n"
+            "\t--output-format=text|binary\n"
+            "\t                           Format of the records written [text]\n"
+            "\t--out-file=<file>          Write records to <file> rather than the\n"
+            "\t                           log; %p is the pid, %q{VAR} is $VAR\n"
+            "\t--out-fd=<n>               Write records to fd <n> rather than the\n"
+            "\t                           log (binary output needs one of these)\n"
+            "\t--stats=no|yes             Print tracing statistics at exit [no]\n"
+            "\t--dump-every=<n>|<n>s      Also print the SB graph every <n> SBs, or\n"
+            "\t                           every <n> seconds; 0 only dumps when the\n"
+            "\t                           program does LOOPGRIND_DUMP() [0]\n"
+            "\t--dump-reset=no|yes        Zero the counts after each dump [no]\n"
+            "\t--control-file=<file>      Poll <file> for queries while running:\n"
+            "\t                           blocks [n], edges [n], loops, shadow, dump\n"
+            "\t--weight-model=exp|linear|step|raw\n"
+            "\t                           How dirty mode weighs SBs by stack depth [exp]\n"
+            "\t--weight-decay=<n>         Stack bytes per 1/e (exp) or step width [512]\n"
+            "\t--weight-cutoff=<n>        SBs deeper than this weigh nothing [1872]\n");
 }
 
 static void lg_print_debug_usage(void)
@@ -559,25 +2781,181 @@ static void lg_print_debug_usage(void)
 
 static void lg_post_clo_init(void)
 {
+    Int i;
+
     /* Make the VEX optimizer stupid. */
     VG_(clo_vex_control).iropt_level = 0;
     VG_(clo_vex_control).iropt_unroll_thresh = 0;
     //    VG_(clo_vex_control).guest_chase_thresh = 0;
+
+    if (clo_weight_model != WEIGHT_RAW)
+    {
+        build_weight_table();
+    }
+
+    if (clo_sample_period)
+    {
+        if (clo_trace_mode != TRACE_DIRTY)
+        {
+            VG_(umsg)("--sample-period only works with --trace-mode=dirty\n");
+            VG_(exit)(1);
+        }
+        if (clo_sample_period < clo_sample_burst)
+        {
+            VG_(umsg)("--sample-period can't be shorter than --sample-burst\n");
+            VG_(exit)(1);
+        }
+
+        /* Start off with a burst so we get to see main() */
+        sample_countdown = clo_sample_burst;
+    }
+
+    for (i = 0; i < n_loops; i++)
+    {
+        loops[i].shadow = new_shadow_table();
+        loops[i].snaps = snapshot_new_copies();
+    }
+
+    if (clo_out_file && clo_out_fd >= 0)
+    {
+        VG_(umsg)("--out-file and --out-fd can't both be given\n");
+        VG_(exit)(1);
+    }
+    if (clo_binary_output && !clo_out_file && clo_out_fd < 0)
+    {
+        VG_(umsg)("--output-format=binary needs --out-file or --out-fd\n");
+        VG_(exit)(1);
+    }
+
+    if (clo_out_file)
+    {
+        if (!out_open_file(clo_out_file, clo_binary_output))
+        {
+            VG_(exit)(1);
+        }
+    }
+    else
+    {
+        out_init(clo_out_fd, clo_binary_output);
+    }
+
+    if (clo_find_loop)
+    {
+        if (n_loops)
+        {
+            VG_(umsg)("--loop-addr=auto can't be mixed with loop addresses\n");
+            VG_(exit)(1);
+        }
+        if (clo_trace_mode != TRACE_DIRTY)
+        {
+            VG_(umsg)("--loop-addr=auto only works with --trace-mode=dirty\n");
+            VG_(exit)(1);
+        }
+    }
+
+    if (clo_shadow_mode == SHADOW_SNAPSHOT && snapshot_n_regions() == 0)
+    {
+        VG_(umsg)("--shadow-mode=snapshot needs at least one --watch region\n");
+        VG_(exit)(1);
+    }
+
+    shadowing = clo_shadow_atstart;
+
+    if (clo_control_file)
+    {
+        /* Bail out now on a bad pattern, rather than at the first poll */
+        VG_(free)(VG_(expand_file_name)("--control-file", clo_control_file));
+    }
+
+    dump_countdown = clo_dump_seconds ? DUMP_CLOCK_SBS : clo_dump_every;
+    last_dump_ms = VG_(read_millisecond_timer)();
+
+    if (clo_trace_mode == TRACE_BUFFERED)
+    {
+        event_buf = VG_(malloc)("event_buf", 
+                clo_event_buffer_size * sizeof(sb_event));
+        transitions = VG_(malloc)("transitions", 
+                clo_event_buffer_size * sizeof(sb_transition));
+    }
 }
 
 
-static void lg_fini(Int exitcode)
+/* Client requests, from loopgrind.h */
+static Bool lg_handle_client_request(ThreadId tid, UWord *args, UWord *ret)
 {
-    sb_record *r;
+    if (!VG_IS_TOOL_USERREQ('L', 'G', args[0]))
+    {
+        return False;
+    }
 
-    VG_(HT_ResetIter)(global_bb_ht);
+    switch (args[0])
+    {
+        case VG_USERREQ__LG_DUMP:
+            dump_now();
+            break;
+
+        case VG_USERREQ__LG_START_TRACING:
+            if (!logging)
+            {
+                start_logging();
+
+                /* Nothing we've seen jumped to whatever runs next, and
+                 * depth counts from wherever that is, rather than from
+                 * main() (which we may never have traced). */
+                curr_bb_addr = 0x0;
+                curr_node = NULL;
+                log_entry_ebp = 0x0;
+            }
+            break;
+
+        case VG_USERREQ__LG_STOP_TRACING:
+            if (clo_trace_mode == TRACE_BUFFERED)
+            {
+                flush_events();
+            }
+            stop_logging();
+            break;
+
+        case VG_USERREQ__LG_START_SHADOWING:
+            set_shadowing(True);
+            break;
+
+        case VG_USERREQ__LG_STOP_SHADOWING:
+            set_shadowing(False);
+            break;
+
+        case VG_USERREQ__LG_MARK_ITERATION:
+            mark_iteration((Addr)args[1]);
+            break;
+
+        default:
+            VG_(umsg)("unknown Loopgrind client request 0x%lx\n", args[0]);
+            return False;
+    }
 
-    while ((r = VG_(HT_Next)(global_bb_ht)) != NULL)
+    *ret = 0;
+    return True;
+}
+
+
+static void lg_fini(Int exitcode)
+{
+    if (n_dumps)
     {
-        //    VG_(umsg)("%08lx\t%lu\n",
-        //                r->addr,
-        //                r->count);
-        pp_sb_record(r);
+        pp_dump_begin();
+    }
+    dump_sb_graph(False);
+
+    if (clo_stats)
+    {
+        ULong n_traced = n_memo_hits + n_memo_misses;
+
+        VG_(umsg)("SB graph: %d nodes, %u edges\n", 
+                VG_(HT_count_nodes)(global_bb_ht),
+                global_edge_table->n_entries);
+        VG_(umsg)("last-successor memo: %llu hits / %llu traced (%llu%%)\n",
+                n_memo_hits, n_traced,
+                n_traced ? (100 * n_memo_hits) / n_traced : 0);
     }
 }
 
@@ -599,9 +2977,17 @@ static void lg_pre_clo_init(void)
             lg_print_usage,
             lg_print_debug_usage);
 
+    VG_(needs_client_requests)   (lg_handle_client_request);
+
+    VG_(track_die_mem_munmap)    (lg_die_mem_munmap);
+    VG_(track_start_client_code) (lg_start_client_code);
+    VG_(atfork)(lg_pre_fork, NULL, lg_child_fork);
+
 
     global_bb_ht = VG_(HT_construct)("global_bb_ht");
-    shadow_table = VG_(HT_construct)("shadow_table");
+    global_edge_table = new_edge_table();
+    loop_body_ht = VG_(HT_construct)("loop_body_ht");
+    loop_member_ht = VG_(HT_construct)("loop_member_ht");
 
 }
 
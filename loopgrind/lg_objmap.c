@@ -0,0 +1,135 @@
+/*--------------------------------------------------------------------*/
+/*--- Loopgrind: an event loop analyzer                lg_objmap.c ---*/
+/*--------------------------------------------------------------------*/
+
+/* This file is a part of a submission for a course project in
+ * CPSC 538W, Execution Mining, at UBC, Winter 2010.
+
+ * Copyright (c) 2010 Nathan Taylor <tnathan@cs.ubc.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lg_objmap.h"
+
+
+/* The code ranges of every object we instrument, sorted by start address
+ * and non-overlapping, so we can binary search them.  There are only ever a
+ * handful of these, but we look them up for every block we translate. */
+static code_range *ranges       = NULL;
+static UInt n_ranges            = 0;
+static UInt ranges_size         = 0;
+
+
+
+static void add_range(const DebugInfo *obj, Addr start, SizeT size)
+{
+    UInt i;
+
+    if (size == 0) return;
+
+    if (n_ranges == ranges_size)
+    {
+        ranges_size = ranges_size ? 2 * ranges_size : 8;
+        ranges = VG_(realloc)("objmap.ranges", ranges, 
+                ranges_size * sizeof(code_range));
+    }
+
+    /* Insertion sort; this happens about once per object */
+    for (i = n_ranges; i > 0 && ranges[i - 1].start > start; i--)
+    {
+        ranges[i] = ranges[i - 1];
+    }
+
+    ranges[i].start = start;
+    ranges[i].end = start + size;
+    ranges[i].obj = obj;
+    n_ranges++;
+}
+
+
+
+/* Track the text and PLT of obj. */
+void objmap_add_object(const DebugInfo *obj)
+{
+    tl_assert(obj);
+
+    if (objmap_has_object(obj)) return;
+
+    add_range(obj, VG_(seginfo_get_text_avma)(obj), 
+                   VG_(seginfo_get_text_size)(obj));
+    add_range(obj, VG_(seginfo_get_plt_avma)(obj), 
+                   VG_(seginfo_get_plt_size)(obj));
+}
+
+Bool objmap_has_object(const DebugInfo *obj)
+{
+    UInt i;
+
+    for (i = 0; i < n_ranges; i++)
+    {
+        if (ranges[i].obj == obj) return True;
+    }
+    return False;
+}
+
+Bool objmap_contains(Addr addr)
+{
+    UInt lo = 0, hi = n_ranges;
+
+    while (lo < hi)
+    {
+        UInt mid = (lo + hi) / 2;
+
+        if (addr < ranges[mid].start)
+        {
+            hi = mid;
+        }
+        else if (addr >= ranges[mid].end)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            return True;
+        }
+    }
+
+    return False;
+}
+
+/* Forget every range overlapping [addr, addr + len), e.g. on munmap. */
+void objmap_remove(Addr addr, SizeT len)
+{
+    UInt i, j;
+
+    for (i = j = 0; i < n_ranges; i++)
+    {
+        if (ranges[i].end <= addr || ranges[i].start >= addr + len)
+        {
+            ranges[j++] = ranges[i];
+        }
+    }
+    n_ranges = j;
+}
+
+UInt objmap_n_ranges(void)
+{
+    return n_ranges;
+}
+
+code_range* objmap_get_range(UInt i)
+{
+    tl_assert(i < n_ranges);
+    return &ranges[i];
+}
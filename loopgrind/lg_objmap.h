@@ -0,0 +1,34 @@
+#ifndef __LG__OBJMAP_H_
+#define __LG__OBJMAP_H_
+
+#include "pub_tool_basics.h"
+#include "pub_tool_mallocfree.h"
+#include "pub_tool_libcassert.h"
+#include "pub_tool_libcprint.h"
+#include "pub_tool_debuginfo.h"
+#include "pub_tool_libcbase.h"
+
+/******************************** structs ************************************/
+
+
+/* A chunk of code belonging to an object we want to instrument: [start, end) */
+typedef struct _code_range
+{
+    Addr                start;
+    Addr                end;
+    const DebugInfo     *obj;
+}
+code_range;
+
+/**************************** Function prototypes ****************************/
+
+void objmap_add_object(const DebugInfo*);
+Bool objmap_has_object(const DebugInfo*);
+Bool objmap_contains(Addr);
+void objmap_remove(Addr, SizeT);
+
+UInt objmap_n_ranges(void);
+code_range* objmap_get_range(UInt);
+
+
+#endif
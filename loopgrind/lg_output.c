@@ -0,0 +1,243 @@
+/*--------------------------------------------------------------------*/
+/*--- Loopgrind: an event loop analyzer                lg_output.c ---*/
+/*--------------------------------------------------------------------*/
+
+/* This file is a part of a submission for a course project in
+ * CPSC 538W, Execution Mining, at UBC, Winter 2010.
+
+ * Copyright (c) 2010 Nathan Taylor <tnathan@cs.ubc.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lg_output.h"
+
+
+#define OUT_BUF_SIZE    (1 << 16)
+
+/* A formatted line has to fit in what's left of the buffer, so flush
+ * before there's less than this. */
+#define OUT_LINE_MAX    2048
+
+static UChar out_buf[OUT_BUF_SIZE + 1];     /* + 1 for the NUL in text mode */
+static UInt out_used            = 0;
+
+/* Where it all goes: an fd of our own, or -1 for wherever VG_(printf)
+ * goes (--log-fd and friends). */
+static Int out_fd               = -1;
+static Bool out_binary          = False;
+
+static Addr out_last_addr       = 0;
+
+/* --out-file, if that's where it's going, and what it expanded to */
+static Char *out_pattern        = NULL;
+static Char *out_name           = NULL;
+
+
+
+void out_init(Int fd, Bool binary)
+{
+    tl_assert(fd >= 0 || !binary);
+
+    out_fd = fd;
+    out_binary = binary;
+
+    if (binary)
+    {
+        out_bytes((const UChar *)"LGB1", 4);
+    }
+}
+
+/* Open the file called name, truncating it. */
+static Int open_out_file(Char *name)
+{
+    SysRes sres = VG_(open)(name, 
+            VKI_O_CREAT | VKI_O_WRONLY | VKI_O_TRUNC,
+            VKI_S_IRUSR | VKI_S_IWUSR | VKI_S_IRGRP | VKI_S_IROTH);
+
+    if (sr_isError(sres))
+    {
+        VG_(umsg)("can't create --out-file %s\n", name);
+        return -1;
+    }
+
+    return sr_Res(sres);
+}
+
+/* Around a fork: the parent's records have to be out of the buffer before
+ * the child gets a copy of it, and then the child gets a file of its own.
+ * That's whatever the pattern expands to now (with %p, say), or if that's
+ * the parent's file, the same name with ".<pid>" on the end; two processes
+ * in one file would mangle each other's records. */
+static void out_pre_fork(ThreadId tid)
+{
+    out_flush();
+}
+
+static void out_child_fork(ThreadId tid)
+{
+    Char *name = VG_(expand_file_name)("--out-file", out_pattern);
+    Int fd;
+
+    if (VG_(strcmp)(name, out_name) == 0)
+    {
+        VG_(free)(name);
+        name = VG_(malloc)("out_name", VG_(strlen)(out_name) + 16);
+        VG_(sprintf)(name, "%s.%d", out_name, VG_(getpid)());
+    }
+
+    fd = open_out_file(name);
+    VG_(free)(out_name);
+    out_name = name;
+
+    VG_(close)(out_fd);
+    out_fd = fd;
+    out_used = 0;
+    out_last_addr = 0;
+
+    if (fd < 0)
+    {
+        out_binary = False;     /* back to the log, then */
+    }
+    else if (out_binary)
+    {
+        out_bytes((const UChar *)"LGB1", 4);
+    }
+}
+
+Bool out_open_file(Char *pattern, Bool binary)
+{
+    Char *name = VG_(expand_file_name)("--out-file", pattern);
+    Int fd = open_out_file(name);
+
+    if (fd < 0)
+    {
+        VG_(free)(name);
+        return False;
+    }
+
+    out_pattern = pattern;
+    out_name = name;
+    out_init(fd, binary);
+    VG_(atfork)(out_pre_fork, NULL, out_child_fork);
+
+    return True;
+}
+
+Bool out_is_binary(void)
+{
+    return out_binary;
+}
+
+/* Is it going somewhere other than the log? */
+Bool out_has_fd(void)
+{
+    return out_fd >= 0;
+}
+
+void out_flush(void)
+{
+    UInt done = 0;
+
+    if (out_used == 0) return;
+
+    if (out_fd < 0)
+    {
+        out_buf[out_used] = '\0';
+        VG_(printf)("%s", out_buf);
+        out_used = 0;
+        return;
+    }
+
+    while (done < out_used)
+    {
+        Int n = VG_(write)(out_fd, out_buf + done, out_used - done);
+
+        if (n <= 0) break;      /* not much we can do about it */
+        done += n;
+    }
+    out_used = 0;
+}
+
+static void make_room(UInt n)
+{
+    if (out_used + n > OUT_BUF_SIZE)
+    {
+        out_flush();
+    }
+}
+
+
+
+void out_printf(const HChar *format, ...)
+{
+    va_list vargs;
+    UInt n;
+
+    tl_assert(!out_binary);
+
+    make_room(OUT_LINE_MAX);
+
+    va_start(vargs, format);
+    n = VG_(vsprintf)((Char *)out_buf + out_used, format, vargs);
+    va_end(vargs);
+
+    tl_assert(n < OUT_LINE_MAX);
+    out_used += n;
+}
+
+
+
+void out_byte(UChar b)
+{
+    make_room(1);
+    out_buf[out_used++] = b;
+}
+
+void out_bytes(const UChar *bytes, UInt n)
+{
+    while (n)
+    {
+        UInt chunk = n < OUT_BUF_SIZE ? n : OUT_BUF_SIZE;
+
+        make_room(chunk);
+        VG_(memcpy)(out_buf + out_used, bytes, chunk);
+        out_used += chunk;
+        bytes += chunk;
+        n -= chunk;
+    }
+}
+
+/* LEB128: seven bits at a time, low bits first, top bit set on all but
+ * the last byte */
+void out_uvarint(ULong v)
+{
+    make_room(10);
+
+    while (v >= 0x80)
+    {
+        out_buf[out_used++] = (UChar)(v | 0x80);
+        v >>= 7;
+    }
+    out_buf[out_used++] = (UChar)v;
+}
+
+/* Addresses are mostly close to the last one written, so write the
+ * difference, zigzagged so that small negative ones stay small. */
+void out_addr(Addr a)
+{
+    Long delta = (Long)a - (Long)out_last_addr;
+
+    out_uvarint(((ULong)delta << 1) ^ (ULong)(delta >> 63));
+    out_last_addr = a;
+}
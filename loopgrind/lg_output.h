@@ -0,0 +1,77 @@
+#ifndef __LG__OUTPUT_H_
+#define __LG__OUTPUT_H_
+
+#include "pub_tool_basics.h"
+#include "pub_tool_libcassert.h"
+#include "pub_tool_mallocfree.h"
+#include "pub_tool_libcprint.h"
+#include "pub_tool_libcbase.h"
+#include "pub_tool_libcfile.h"
+#include "pub_tool_libcproc.h"
+#include "pub_tool_options.h"
+#include "pub_tool_vki.h"
+
+/* Everything Loopgrind reports (NODE, EDGE, W lines and so on) goes
+ * through here rather than straight to VG_(printf), so that it can be
+ * buffered up and written out in bulk.
+ *
+ * With --output-format=binary the same records get written in a compact
+ * form instead: the file starts with "LGB1", then each record is a tag byte
+ * followed by LEB128 varints.  Addresses are written as the zigzag-encoded
+ * difference from the address before them, whatever record that was in.
+ *
+ *  'N' addr count err              SB graph node
+ *  'F' addr len name[len]          ...its function name
+ *  'E' src dst count err           SB graph edge
+ *  'D' addr                        start of a loop header's memory diff
+ *  'W' addr type old new           a store (plus old_hi new_hi for V128);
+ *                                  type is as below
+ *  'R' addr len old[len] ok        a range of stores; if ok (a byte) is
+ *      [new[len]]                  1, the bytes as they are now follow
+ *  'd'                             end of the memory diff
+ *  'L' addr iterations entries     a loop header's counts
+ *  'S' period burst bursts         sampling parameters
+ *  'G' n ms                        start of the n'th dump of the SB graph
+ *                                  (--dump-every), taken at ms
+ *
+ * A store's type is its size in bytes, plus OUT_TYPE_FLOAT for F32 and F64
+ * or OUT_TYPE_VECTOR for V128: 0x01, 0x02, 0x04 or 0x08 for integers, 0x44
+ * or 0x48 for floats (old and new are their bit patterns), 0x90 for V128.
+ *
+ * A loop's diff covers one iteration, from a hit on its header up to the
+ * next one, or up to leaving the loop for a block outside its body if
+ * it's nested (see left_loop_body); the text form is the same.  Leaving
+ * early on a path the body hadn't taken yet counts as an extra entry.
+ */
+
+#define OUT_TAG_NODE        'N'
+#define OUT_TAG_FNNAME      'F'
+#define OUT_TAG_EDGE        'E'
+#define OUT_TAG_DIFF        'D'
+#define OUT_TAG_WRITE       'W'
+#define OUT_TAG_RANGE       'R'
+#define OUT_TAG_DIFF_END    'd'
+#define OUT_TAG_LOOP        'L'
+#define OUT_TAG_SAMPLE      'S'
+#define OUT_TAG_DUMP        'G'
+
+#define OUT_TYPE_FLOAT      0x40
+#define OUT_TYPE_VECTOR     0x80
+
+/**************************** Function prototypes ****************************/
+
+void out_init(Int fd, Bool binary);
+Bool out_open_file(Char *pattern, Bool binary);
+Bool out_is_binary(void);
+Bool out_has_fd(void);
+void out_flush(void);
+
+void out_printf(const HChar *format, ...);
+
+void out_byte(UChar);
+void out_bytes(const UChar*, UInt);
+void out_uvarint(ULong);
+void out_addr(Addr);
+
+
+#endif
@@ -0,0 +1,210 @@
+/*--------------------------------------------------------------------*/
+/*--- Loopgrind: an event loop analyzer              lg_snapshot.c ---*/
+/*--------------------------------------------------------------------*/
+
+/* This file is a part of a submission for a course project in
+ * CPSC 538W, Execution Mining, at UBC, Winter 2010.
+
+ * Copyright (c) 2010 Nathan Taylor <tnathan@cs.ubc.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "lg_snapshot.h"
+
+
+#define MAX_WATCH_REGIONS 16
+
+static watch_region regions[MAX_WATCH_REGIONS];
+static UInt n_regions           = 0;
+
+
+
+/* Parse "<addr>:<len>" (address in hex, length in decimal or 0x-hex) and
+ * start watching it.  Returns False if spec doesn't make sense. */
+Bool snapshot_add_region(Char *spec)
+{
+    Char *p;
+    Addr start;
+    Long len;
+
+    start = (Addr)VG_(strtoll16)(spec, &p);
+    if (p == spec || *p != ':') return False;
+
+    spec = p + 1;
+    if (spec[0] == '0' && (spec[1] == 'x' || spec[1] == 'X'))
+    {
+        len = VG_(strtoll16)(spec, &p);
+    }
+    else
+    {
+        len = VG_(strtoll10)(spec, &p);
+    }
+    if (p == spec || *p != '\0' || len <= 0) return False;
+
+    if (n_regions == MAX_WATCH_REGIONS)
+    {
+        VG_(umsg)("too many --watch regions (max %d)\n", MAX_WATCH_REGIONS);
+        return False;
+    }
+
+    regions[n_regions].start = start;
+    regions[n_regions].len = (SizeT)len;
+    n_regions++;
+
+    return True;
+}
+
+UInt snapshot_n_regions(void)
+{
+    return n_regions;
+}
+
+/* A loop's copies of the regions, none taken yet; NULL if there aren't
+ * any regions.  Only call this once the options have all been read. */
+watch_copy* snapshot_new_copies(void)
+{
+    if (n_regions == 0) return NULL;
+
+    return VG_(calloc)("watch_copy", n_regions, sizeof(watch_copy));
+}
+
+static void take_copy(watch_region *w, watch_copy *c)
+{
+    if (!c->snap)
+    {
+        c->snap = VG_(malloc)("watch_copy.snap", w->len);
+    }
+    VG_(memcpy)(c->snap, (void *)w->start, w->len);
+    c->snap_valid = True;
+}
+
+
+/* Report one changed chunk of a region the same way a shadowed store
+ * would be. */
+static void report_change(Addr addr, IRType type, ULong oldval, ULong newval)
+{
+    shadow_record r;
+
+    VG_(memset)(&r, 0, sizeof(r));
+    r.addr = addr;
+    r.type = type;
+    r.oldval = oldval;
+    r.newval = newval;
+    pp_shadow_record(&r);
+}
+
+/* Compare [start, start + len) against snap a ULong at a time, reporting
+ * (and updating snap with) whatever changed.  Any bytes before the first
+ * aligned word or after the last one get compared bytewise. */
+void snapshot_diff(Addr start, UChar *snap, SizeT len)
+{
+    UChar *mem = (UChar *)start;
+    SizeT i = 0;
+
+    while (i < len && ((start + i) & 7))
+    {
+        if (mem[i] != snap[i])
+        {
+            report_change(start + i, Ity_I8, snap[i], mem[i]);
+            snap[i] = mem[i];
+        }
+        i++;
+    }
+
+    for (/* use current i */; i + 8 <= len; i += 8)
+    {
+        ULong now = *(ULong *)(mem + i);
+        ULong then;
+
+        VG_(memcpy)(&then, snap + i, 8);
+        if (now != then)
+        {
+            report_change(start + i, Ity_I64, then, now);
+            VG_(memcpy)(snap + i, &now, 8);
+        }
+    }
+
+    for (/* use current i */; i < len; i++)
+    {
+        if (mem[i] != snap[i])
+        {
+            report_change(start + i, Ity_I8, snap[i], mem[i]);
+            snap[i] = mem[i];
+        }
+    }
+}
+
+/* Called at a loop's header: report what changed in every region since
+ * the loop's last iteration, then remember what they look like now.  A
+ * region that isn't mapped (yet, or any more) is skipped, and the next time
+ * it shows up it's only copied. */
+void snapshot_diff_regions(watch_copy *copies)
+{
+    UInt i;
+
+    for (i = 0; i < n_regions; i++)
+    {
+        watch_region *w = &regions[i];
+        watch_copy *c = &copies[i];
+
+        if (!VG_(am_is_valid_for_client)(w->start, w->len, VKI_PROT_READ))
+        {
+            c->snap_valid = False;
+            continue;
+        }
+
+        if (c->snap_valid)
+        {
+            snapshot_diff(w->start, c->snap, w->len);
+        }
+        else
+        {
+            take_copy(w, c);
+        }
+    }
+}
+
+/* Called on entering a loop: copy every region afresh, so that the first
+ * iteration gets diffed like the rest, and not against whatever the loop's
+ * last entry left behind. */
+void snapshot_take_regions(watch_copy *copies)
+{
+    UInt i;
+
+    for (i = 0; i < n_regions; i++)
+    {
+        watch_region *w = &regions[i];
+
+        if (VG_(am_is_valid_for_client)(w->start, w->len, VKI_PROT_READ))
+        {
+            take_copy(w, &copies[i]);
+        }
+        else
+        {
+            copies[i].snap_valid = False;
+        }
+    }
+}
+
+/* Throw away a loop's copies, so that its next diff starts afresh rather
+ * than covering everything since the last one. */
+void snapshot_forget_regions(watch_copy *copies)
+{
+    UInt i;
+
+    for (i = 0; i < n_regions; i++)
+    {
+        copies[i].snap_valid = False;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef __LG__SNAPSHOT_H_
+#define __LG__SNAPSHOT_H_
+
+#include "pub_tool_basics.h"
+#include "pub_tool_mallocfree.h"
+#include "pub_tool_libcassert.h"
+#include "pub_tool_libcprint.h"
+#include "pub_tool_libcbase.h"
+#include "pub_tool_aspacemgr.h"
+#include "pub_tool_vki.h"
+
+#include "lg_hash.h"
+
+/******************************** structs ************************************/
+
+
+/* A range of guest memory that gets compared against a copy of itself from
+ * the last loop iteration, rather than having every store into it shadowed:
+ * [start, start + len) */
+typedef struct _watch_region
+{
+    Addr                start;
+    SizeT               len;
+}
+watch_region;
+
+/* What a region looked like at one loop's last iteration.  Each loop has
+ * its own copy of every region, so an inner loop's iterations don't move
+ * the copy an outer loop's iteration gets diffed against. */
+typedef struct _watch_copy
+{
+    UChar               *snap;      /* allocated on first use */
+    Bool                snap_valid;
+}
+watch_copy;
+
+/**************************** Function prototypes ****************************/
+
+Bool snapshot_add_region(Char *spec);
+UInt snapshot_n_regions(void);
+watch_copy* snapshot_new_copies(void);
+void snapshot_diff_regions(watch_copy*);
+void snapshot_forget_regions(watch_copy*);
+void snapshot_take_regions(watch_copy*);
+void snapshot_diff(Addr start, UChar *snap, SizeT len);
+
+
+#endif
@@ -0,0 +1,110 @@
+/*--------------------------------------------------------------------*/
+/*--- Loopgrind: an event loop analyzer                loopgrind.h ---*/
+/*--------------------------------------------------------------------*/
+
+/* This file is a part of a submission for a course project in
+ * CPSC 538W, Execution Mining, at UBC, Winter 2010.
+
+ * Copyright (c) 2010 Nathan Taylor <tnathan@cs.ubc.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Client requests for programs running under Loopgrind.  Like the rest of
+ * valgrind.h, these do nothing (and cost next to nothing) when the program
+ * isn't running under Valgrind at all. */
+
+#ifndef __LOOPGRIND_H
+#define __LOOPGRIND_H
+
+#include "valgrind.h"
+
+/* !! ABIWARNING !! ABIWARNING !! ABIWARNING !! ABIWARNING !!
+   This enum comprises an ABI exported by Valgrind to programs
+   which use client requests.  DO NOT CHANGE THE ORDER OF THESE
+   ENTRIES, NOR DELETE ANY -- add new ones at the end. */
+typedef
+   enum {
+      VG_USERREQ__LG_DUMP = VG_USERREQ_TOOL_BASE('L','G'),
+      VG_USERREQ__LG_START_TRACING,
+      VG_USERREQ__LG_STOP_TRACING,
+      VG_USERREQ__LG_START_SHADOWING,
+      VG_USERREQ__LG_STOP_SHADOWING,
+      VG_USERREQ__LG_MARK_ITERATION
+   } Vg_LoopgrindClientRequest;
+
+
+/* Print the SB graph as it stands right now, without waiting for the
+ * program to exit; the counts get reset afterwards if --dump-reset=yes. */
+#define LOOPGRIND_DUMP()                                          \
+   do {                                                           \
+      unsigned long _qzz_res;                                     \
+      VALGRIND_DO_CLIENT_REQUEST(_qzz_res, 0,                     \
+                                 VG_USERREQ__LG_DUMP,             \
+                                 0, 0, 0, 0, 0);                  \
+   } while (0)
+
+/* Start or stop building the SB graph (and shadowing stores, which only
+ * happens in code that's being traced).  With --trace-atstart=no nothing
+ * gets traced until the program starts it, so setup code can be skipped
+ * entirely.  Starting before main() is reached takes effect at main(). */
+#define LOOPGRIND_START_TRACING()                                 \
+   do {                                                           \
+      unsigned long _qzz_res;                                     \
+      VALGRIND_DO_CLIENT_REQUEST(_qzz_res, 0,                     \
+                                 VG_USERREQ__LG_START_TRACING,    \
+                                 0, 0, 0, 0, 0);                  \
+   } while (0)
+
+#define LOOPGRIND_STOP_TRACING()                                  \
+   do {                                                           \
+      unsigned long _qzz_res;                                     \
+      VALGRIND_DO_CLIENT_REQUEST(_qzz_res, 0,                     \
+                                 VG_USERREQ__LG_STOP_TRACING,     \
+                                 0, 0, 0, 0, 0);                  \
+   } while (0)
+
+/* Start or stop shadowing stores for the loop memory diffs, while leaving
+ * the SB graph alone.  Either way, whatever the current iterations had
+ * stored so far is forgotten.  See also --shadow-atstart=no. */
+#define LOOPGRIND_START_SHADOWING()                               \
+   do {                                                           \
+      unsigned long _qzz_res;                                     \
+      VALGRIND_DO_CLIENT_REQUEST(_qzz_res, 0,                     \
+                                 VG_USERREQ__LG_START_SHADOWING,  \
+                                 0, 0, 0, 0, 0);                  \
+   } while (0)
+
+#define LOOPGRIND_STOP_SHADOWING()                                \
+   do {                                                           \
+      unsigned long _qzz_res;                                     \
+      VALGRIND_DO_CLIENT_REQUEST(_qzz_res, 0,                     \
+                                 VG_USERREQ__LG_STOP_SHADOWING,   \
+                                 0, 0, 0, 0, 0);                  \
+   } while (0)
+
+/* The top of an iteration of loop _qzz_id, just as if execution had hit a
+ * --loop-addr header: the first mark enters the loop and each one after
+ * that reports the memory diff of the iteration before.  The id is only a
+ * name for the loop (1, 2, ... will do); nested loops need different ids.
+ * Marked loops don't need a --loop-addr, and count against its limit. */
+#define LOOPGRIND_MARK_ITERATION(_qzz_id)                         \
+   do {                                                           \
+      unsigned long _qzz_res;                                     \
+      VALGRIND_DO_CLIENT_REQUEST(_qzz_res, 0,                     \
+                                 VG_USERREQ__LG_MARK_ITERATION,   \
+                                 (_qzz_id), 0, 0, 0, 0);          \
+   } while (0)
+
+
+#endif
@@ -0,0 +1,39 @@
+/* clientreq.c
+ * The loop from simpleloop.c, bracketed with loopgrind.h client requests:
+ * tracing is started from inside a setup function (so its caller's frame
+ * is above where tracing began), each iteration is marked explicitly, and
+ * tracing stops before the teardown.  Run with --trace-atstart=no.
+ */
+
+#include <stdio.h>
+
+#include "loopgrind.h"
+
+static int table[64];
+
+static void setup(void) {
+    int i;
+
+    for (i = 0; i < 64; ++i) {
+        table[i] = i * i;
+    }
+
+    LOOPGRIND_START_TRACING();
+}
+
+int main(int argc, char *argv[]) {
+    int j, sum = 0;
+
+    setup();
+
+    for (j = 0; j < 20; ++j) {
+        LOOPGRIND_MARK_ITERATION(1);
+        sum += table[j];
+        table[j + 1] += sum;
+    }
+
+    LOOPGRIND_STOP_TRACING();
+
+    printf("%d\n", sum);
+    return 0;
+}